@@ -0,0 +1,534 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <csignal>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "headers/tree.h"
+
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+// How long a single command may take before it is counted as failed.
+#define LINE_TIMEOUT 15000
+
+#define EXIT_TIMEOUT 20000
+
+// Runs a server as a child process and talks to it over its stdin/stdout,
+// the same way a user at the terminal would.
+class ServerProcess {
+private:
+    pid_t pid = -1;
+    int input = -1;
+    int output = -1;
+    string buffer;
+
+    // Moves whatever the server printed into the buffer; false on EOF.
+    bool fill() {
+        char chunk[4096];
+        ssize_t n = read(output, chunk, sizeof(chunk));
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(chunk, n);
+        return true;
+    }
+
+public:
+    ServerProcess(const string &path, const vector<string> &args) {
+        int toServer[2], fromServer[2];
+        if (pipe(toServer) == -1 || pipe(fromServer) == -1) {
+            throw runtime_error("pipe error");
+        }
+        pid = fork();
+        if (pid == -1) {
+            throw runtime_error("Can not fork.");
+        }
+        if (pid == 0) {
+            dup2(toServer[0], STDIN_FILENO);
+            dup2(fromServer[1], STDOUT_FILENO);
+            close(toServer[0]);
+            close(toServer[1]);
+            close(fromServer[0]);
+            close(fromServer[1]);
+            vector<char *> argv = {(char *) path.c_str()};
+            for (const string &arg: args) {
+                argv.push_back((char *) arg.c_str());
+            }
+            argv.push_back(nullptr);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+        close(toServer[0]);
+        close(fromServer[1]);
+        input = toServer[1];
+        output = fromServer[0];
+    }
+
+    ServerProcess(const ServerProcess &) = delete;
+
+    ServerProcess &operator=(const ServerProcess &) = delete;
+
+    ~ServerProcess() {
+        send("exit\n");
+        close(input);
+        Clock::time_point deadline = Clock::now() + chrono::milliseconds(EXIT_TIMEOUT);
+        while (waitpid(pid, nullptr, WNOHANG) == 0) {
+            if (Clock::now() > deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+                break;
+            }
+            usleep(50'000);
+        }
+        close(output);
+    }
+
+    // Keeps draining the server's output while writing, so a large batch
+    // cannot deadlock against a server blocked on a full stdout pipe.
+    void send(const string &text) {
+        size_t written = 0;
+        while (written < text.size()) {
+            pollfd fds[] = {{input, POLLOUT, 0}, {output, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) { continue; }
+                throw runtime_error("poll error");
+            }
+            if (fds[1].revents & POLLIN) {
+                fill();
+            }
+            if (fds[0].revents & (POLLERR | POLLHUP)) {
+                throw runtime_error("server closed its input");
+            }
+            if (fds[0].revents & POLLOUT) {
+                ssize_t n = write(input, text.data() + written, min<size_t>(text.size() - written, 4096));
+                if (n > 0) {
+                    written += n;
+                }
+            }
+        }
+    }
+
+    bool readLine(string &line, Clock::time_point deadline) {
+        while (true) {
+            size_t end = buffer.find('\n');
+            if (end != string::npos) {
+                line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+                return true;
+            }
+            long left = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+            if (left <= 0) {
+                return false;
+            }
+            pollfd fd = {output, POLLIN, 0};
+            int ready = poll(&fd, 1, (int) left);
+            if (ready == -1 && errno != EINTR) {
+                throw runtime_error("poll error");
+            }
+            if (ready > 0 && !fill()) {
+                return false;
+            }
+        }
+    }
+
+    // Skips lines until `match` accepts one; nodes share the server's
+    // stdout, so their start and exit notices are interleaved with replies.
+    bool await(const function<bool(const string &)> &match, string &line, int timeout = LINE_TIMEOUT) {
+        Clock::time_point deadline = Clock::now() + chrono::milliseconds(timeout);
+        while (readLine(line, deadline)) {
+            if (match(line)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct Series {
+    string operation;
+    int payload = 0;
+    vector<double> latencies;
+    int failures = 0;
+    double seconds = 0;
+    // Operations counted by the throughput figure, which may come from a
+    // separate pipelined run.
+    int operations = 0;
+
+    explicit Series(string operation, int payload = 0) : operation(move(operation)), payload(payload) {}
+
+    // Nearest-rank percentile in microseconds.
+    double percentile(double p) const {
+        if (latencies.empty()) {
+            return 0;
+        }
+        vector<double> sorted = latencies;
+        sort(sorted.begin(), sorted.end());
+        size_t rank = (size_t) max(0.0, ceil(p / 100 * sorted.size()) - 1);
+        return sorted[min(rank, sorted.size() - 1)];
+    }
+
+    double mean() const {
+        double total = 0;
+        for (double latency: latencies) {
+            total += latency;
+        }
+        return latencies.empty() ? 0 : total / latencies.size();
+    }
+
+    double throughput() const {
+        return seconds > 0 ? operations / seconds : 0;
+    }
+};
+
+struct BenchOptions {
+    string server = "./server";
+    vector<string> serverArgs;
+    string shape = "balanced";
+    int nodes = 15;
+    int iterations = 200;
+    vector<int> payloads = {1, 64, 1000, 4000};
+    int heartbeat = 100;
+    int sweeps = 20;
+    string route = "tree";
+    // Result cache capacity per node; off by default, as every exec
+    // repeats the same payload and would only measure cache hits.
+    int cache = 0;
+    string format = "csv";
+    string output;
+    unsigned seed = 1;
+
+    void parse(int argc, char const *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--") {
+                serverArgs.assign(argv + i + 1, argv + argc);
+                break;
+            }
+            size_t eq = arg.find('=');
+            if (arg.rfind("--", 0) != 0 || eq == string::npos) {
+                throw runtime_error("unknown option " + arg);
+            }
+            string key = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+            if (key == "server") {
+                server = value;
+            } else if (key == "shape") {
+                shape = value;
+            } else if (key == "nodes") {
+                nodes = stoi(value);
+            } else if (key == "iterations") {
+                iterations = stoi(value);
+            } else if (key == "payloads") {
+                payloads.clear();
+                istringstream list(value);
+                string item;
+                while (getline(list, item, ',')) {
+                    payloads.push_back(stoi(item));
+                }
+            } else if (key == "heartbeat") {
+                heartbeat = stoi(value);
+            } else if (key == "sweeps") {
+                sweeps = stoi(value);
+            } else if (key == "route") {
+                route = value;
+            } else if (key == "cache") {
+                cache = stoi(value);
+            } else if (key == "format") {
+                format = value;
+            } else if (key == "output") {
+                output = value;
+            } else if (key == "seed") {
+                seed = stoul(value);
+            } else {
+                throw runtime_error("unknown option " + arg);
+            }
+        }
+        if (shape != "balanced" && shape != "chain" && shape != "random") {
+            throw runtime_error("unknown shape " + shape);
+        }
+        if (format != "csv" && format != "json") {
+            throw runtime_error("unknown format " + format);
+        }
+        if (route != "tree" && route != "direct") {
+            throw runtime_error("unknown routing mode " + route);
+        }
+    }
+};
+
+// Ids in the order they must be created for the server's search tree,
+// rooted at node 0, to take the requested shape.
+vector<int> insertionOrder(const string &shape, int n, mt19937 &rng) {
+    vector<int> ids;
+    for (int i = 1; i <= n; ++i) {
+        ids.push_back(i);
+    }
+    if (shape == "chain") {
+        // Every id is smaller than the previous one, so each hangs off the
+        // left; negative ids would collide with the reserved message targets.
+        reverse(ids.begin(), ids.end());
+    } else if (shape == "random") {
+        shuffle(ids.begin(), ids.end(), rng);
+    } else {
+        ids = Tree::balancedOrder(ids);
+    }
+    return ids;
+}
+
+// Depth of the tree the server builds from `order`, node 0 included.
+int treeDepth(const vector<int> &order) {
+    Tree t;
+    t.insert(0);
+    for (int id: order) {
+        t.insert(id);
+    }
+    return t.getDepth();
+}
+
+bool startsWith(const string &line, const string &prefix) {
+    return line.rfind(prefix, 0) == 0;
+}
+
+class Bench {
+private:
+    BenchOptions options;
+    ServerProcess server;
+    mt19937 rng;
+    vector<int> ids;
+    int nextJob = 0;
+
+    static double micros(Clock::time_point from, Clock::time_point to) {
+        return chrono::duration<double, micro>(to - from).count();
+    }
+
+    int randomNode() {
+        return ids[uniform_int_distribution<size_t>(0, ids.size() - 1)(rng)];
+    }
+
+    static string payload(int n) {
+        ostringstream out;
+        out << n;
+        for (int i = 1; i <= n; ++i) {
+            out << ' ' << i;
+        }
+        return out.str();
+    }
+
+public:
+    explicit Bench(const BenchOptions &benchOptions) :
+            options(benchOptions), server(benchOptions.server, benchOptions.serverArgs), rng(benchOptions.seed) {
+        string line;
+        if (!server.await([](const string &l) { return l.find("client 0 successfully started") != string::npos; },
+                          line)) {
+            throw runtime_error("server did not start");
+        }
+        if (options.route == "direct") {
+            server.send("route direct\n");
+            server.await([](const string &l) { return l == "OK"; }, line);
+        }
+    }
+
+    Series create(const vector<int> &order) {
+        Series series{"create"};
+        string line;
+        Clock::time_point begin = Clock::now();
+        for (int id: order) {
+            Clock::time_point start = Clock::now();
+            server.send("create " + to_string(id) + "\n");
+            bool ok = server.await([](const string &l) {
+                return (startsWith(l, "OK: ") && l.find("job") == string::npos) || startsWith(l, "Error");
+            }, line) && startsWith(line, "OK");
+            if (ok) {
+                series.latencies.push_back(micros(start, Clock::now()));
+                ids.push_back(id);
+            } else {
+                ++series.failures;
+            }
+        }
+        if (ids.empty()) {
+            throw runtime_error("no node could be created");
+        }
+        series.seconds = chrono::duration<double>(Clock::now() - begin).count();
+        series.operations = (int) series.latencies.size();
+        return series;
+    }
+
+    void sizeCaches() {
+        string line;
+        for (int id: ids) {
+            server.send("cache " + to_string(id) + " size " + to_string(options.cache) + "\n");
+            server.await([](const string &l) {
+                return startsWith(l, "OK: node") || startsWith(l, "Node ") || startsWith(l, "Error");
+            }, line);
+        }
+    }
+
+    Series status() {
+        Series series{"status"};
+        string line;
+        Clock::time_point begin = Clock::now();
+        for (int i = 0; i < options.iterations; ++i) {
+            Clock::time_point start = Clock::now();
+            server.send("status " + to_string(randomNode()) + "\n");
+            bool ok = server.await([](const string &l) {
+                return l == "OK" || startsWith(l, "Node ") || startsWith(l, "Error");
+            }, line) && line == "OK";
+            if (ok) {
+                series.latencies.push_back(micros(start, Clock::now()));
+            } else {
+                ++series.failures;
+            }
+        }
+        series.seconds = chrono::duration<double>(Clock::now() - begin).count();
+        series.operations = (int) series.latencies.size();
+        return series;
+    }
+
+    // Latency is measured one exec at a time, up to its result; throughput
+    // by queueing every exec first and waiting for all of them at once.
+    Series exec(int n) {
+        Series series{"exec", n};
+        string values = payload(n), line;
+        for (int i = 0; i < options.iterations; ++i) {
+            int job = nextJob++;
+            string tag = "job " + to_string(job) + ":";
+            Clock::time_point start = Clock::now();
+            server.send("exec " + to_string(randomNode()) + " " + values + "\nwait " + to_string(job) + "\n");
+            bool ok = server.await([&tag](const string &l) { return l.find(tag) != string::npos; }, line) &&
+                      startsWith(line, "OK");
+            if (ok) {
+                series.latencies.push_back(micros(start, Clock::now()));
+            } else {
+                ++series.failures;
+            }
+        }
+        ostringstream batch;
+        for (int i = 0; i < options.iterations; ++i) {
+            batch << "exec " << randomNode() << " " << values << "\n";
+        }
+        int first = nextJob, last = nextJob + options.iterations - 1;
+        nextJob += options.iterations;
+        batch << "wait";
+        for (int job = first; job <= last; ++job) {
+            batch << ' ' << job;
+        }
+        batch << "\n";
+        string tag = "job " + to_string(last) + ":";
+        Clock::time_point begin = Clock::now();
+        server.send(batch.str());
+        if (server.await([&tag](const string &l) { return l.find(tag) != string::npos; }, line,
+                         LINE_TIMEOUT * options.iterations)) {
+            series.seconds = chrono::duration<double>(Clock::now() - begin).count();
+            series.operations = options.iterations;
+        }
+        return series;
+    }
+
+    // The heartbeat sleeps `heartbeat` ms after each sweep; whatever is
+    // left of the interval between two reports is the sweep itself.
+    Series heartbeat() {
+        Series series{"heartbeat"};
+        string line;
+        Clock::time_point begin = Clock::now(), previous = begin;
+        server.send("heartbeat " + to_string(options.heartbeat) + "\n");
+        for (int i = 0; i < options.sweeps; ++i) {
+            if (!server.await([](const string &l) { return l == "OK" || startsWith(l, "Heartbeat:"); }, line)) {
+                ++series.failures;
+                break;
+            }
+            if (line != "OK") {
+                ++series.failures;
+                continue;
+            }
+            Clock::time_point now = Clock::now();
+            double sweep = micros(previous, now) - (i ? options.heartbeat * 1000.0 : 0);
+            series.latencies.push_back(max(sweep, 0.0));
+            previous = now;
+        }
+        // Sweeps per second of sweeping, without the sleeps in between.
+        series.seconds = series.mean() * series.latencies.size() / 1e6;
+        series.operations = (int) series.latencies.size();
+        server.send("heartbeat\n");
+        return series;
+    }
+};
+
+void writeCsv(ostream &out, const BenchOptions &options, int depth, const vector<Series> &results) {
+    out << "operation,shape,nodes,depth,route,payload,samples,failures,p50_us,p99_us,p999_us,mean_us,throughput_ops\n";
+    for (const Series &s: results) {
+        out << s.operation << ',' << options.shape << ',' << options.nodes << ',' << depth << ',' << options.route
+            << ',' << s.payload << ',' << s.latencies.size() << ',' << s.failures << ',' << s.percentile(50) << ','
+            << s.percentile(99) << ',' << s.percentile(99.9) << ',' << s.mean() << ',' << s.throughput() << '\n';
+    }
+}
+
+void writeJson(ostream &out, const BenchOptions &options, int depth, const vector<Series> &results) {
+    out << "{\"shape\": \"" << options.shape << "\", \"nodes\": " << options.nodes << ", \"depth\": " << depth
+        << ", \"route\": \"" << options.route << "\", \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Series &s = results[i];
+        out << (i ? ", " : "") << "\n  {\"operation\": \"" << s.operation << "\", \"payload\": " << s.payload
+            << ", \"samples\": " << s.latencies.size() << ", \"failures\": " << s.failures
+            << ", \"p50_us\": " << s.percentile(50) << ", \"p99_us\": " << s.percentile(99)
+            << ", \"p999_us\": " << s.percentile(99.9) << ", \"mean_us\": " << s.mean()
+            << ", \"throughput_ops\": " << s.throughput() << "}";
+    }
+    out << "\n]}\n";
+}
+
+// usage: bench [--shape=balanced|chain|random] [--nodes=N] [--iterations=N]
+//              [--payloads=1,64,...] [--heartbeat=MS] [--sweeps=N]
+//              [--route=tree|direct] [--cache=N] [--format=csv|json] [--output=FILE]
+//              [--seed=N] [--server=PATH] [-- server options...]
+int main(int argc, char const *argv[]) {
+    try {
+        signal(SIGPIPE, SIG_IGN);
+        BenchOptions options;
+        options.parse(argc, argv);
+        mt19937 rng(options.seed);
+        vector<int> order = insertionOrder(options.shape, options.nodes, rng);
+        int depth = treeDepth(order);
+        vector<Series> results;
+        {
+            Bench bench(options);
+            cerr << "create: " << options.nodes << " nodes, depth " << depth << endl;
+            results.push_back(bench.create(order));
+            bench.sizeCaches();
+            cerr << "status" << endl;
+            results.push_back(bench.status());
+            for (int n: options.payloads) {
+                cerr << "exec: " << n << " values" << endl;
+                results.push_back(bench.exec(n));
+            }
+            cerr << "heartbeat" << endl;
+            results.push_back(bench.heartbeat());
+        }
+        ofstream file;
+        if (!options.output.empty()) {
+            file.open(options.output);
+            if (!file) {
+                throw runtime_error("can not open " + options.output);
+            }
+        }
+        ostream &out = options.output.empty() ? cout : file;
+        if (options.format == "json") {
+            writeJson(out, options, depth, results);
+        } else {
+            writeCsv(out, options, depth, results);
+        }
+    } catch (const runtime_error &err) {
+        cerr << err.what() << endl;
+        return 1;
+    }
+    return 0;
+}
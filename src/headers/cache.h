@@ -0,0 +1,130 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include "message.h"
+
+using namespace std;
+
+// Results of recent exec requests, keyed by a hash of the reduction and
+// the payload and evicted least recently used first. Two payloads that
+// collide in all 64 bits share an answer; no payload is kept to tell them
+// apart, so a hit costs one pass over the payload and nothing more.
+class ResultCache {
+private:
+    using Entry = pair<uint64_t, double>;
+
+    // Most recently used first.
+    list<Entry> order;
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    size_t capacity;
+
+    static uint64_t rotate(uint64_t x, int bits) {
+        return (x << bits) | (x >> (64 - bits));
+    }
+
+    static uint64_t round(uint64_t lane, uint64_t word) {
+        return rotate(lane + word * 0xC2B2AE3D27D4EB4FULL, 31) * 0x9E3779B185EBCA87ULL;
+    }
+
+    // Finalizer of splitmix64.
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    void evict() {
+        while (order.size() > capacity) {
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+    }
+
+public:
+    explicit ResultCache(size_t capacity) : capacity(capacity) {}
+
+    // Four independent lanes keep the multiplies of neighbouring words
+    // from waiting on each other.
+    static uint64_t hashBytes(const void *data, size_t n, uint64_t seed) {
+        const char *bytes = (const char *) data;
+        uint64_t lanes[4] = {seed, seed + 1, seed + 2, seed + 3};
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            for (int lane = 0; lane < 4; ++lane) {
+                uint64_t word;
+                memcpy(&word, bytes + i + 8 * lane, sizeof(word));
+                lanes[lane] = round(lanes[lane], word);
+            }
+        }
+        for (int lane = 0; i < n; i += 8, lane = (lane + 1) % 4) {
+            uint64_t word = 0;
+            memcpy(&word, bytes + i, min((size_t) 8, n - i));
+            lanes[lane] = round(lanes[lane], word);
+        }
+        return mix(rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18) + n);
+    }
+
+    // The same values in the same type reduced the same way; the wire
+    // encoding they arrived in does not matter.
+    static uint64_t keyOf(const Message &msg) {
+        uint64_t seed = (uint64_t) msg.opcode << 8 | (uint64_t) msg.type;
+        return hashBytes(msg.value, msg.size * payloadWidth(msg.type), seed);
+    }
+
+    bool enabled() const {
+        return capacity > 0;
+    }
+
+    bool find(uint64_t key, double &result) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return false;
+        }
+        order.splice(order.begin(), order, it->second);
+        result = it->second->second;
+        return true;
+    }
+
+    void insert(uint64_t key, double result) {
+        if (!enabled()) {
+            return;
+        }
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = result;
+            order.splice(order.begin(), order, it->second);
+            return;
+        }
+        order.emplace_front(key, result);
+        index[key] = order.begin();
+        evict();
+    }
+
+    void clear() {
+        order.clear();
+        index.clear();
+    }
+
+    // Evicts the least recently used results that no longer fit; 0 turns
+    // the cache off.
+    void resize(size_t newCapacity) {
+        capacity = newCapacity;
+        evict();
+    }
+
+    size_t size() const {
+        return order.size();
+    }
+
+    size_t getCapacity() const {
+        return capacity;
+    }
+};
+
+#endif
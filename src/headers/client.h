@@ -0,0 +1,1423 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <csignal>
+#include <chrono>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include "message.h"
+#include "socket.h"
+#include "options.h"
+#include "kernels.h"
+#include "queue.h"
+#include "stats.h"
+#include "cache.h"
+
+using namespace std;
+
+// How long a relay waits for a child's reply before answering with ERROR.
+#define CHILD_TIMEOUT 5000
+
+#define SWEEP_INTERVAL 100
+
+// Frames handled per socket before the loop polls the others again.
+#define RECEIVE_BATCH 64
+
+// The same for bulk lanes, so a control frame that arrives meanwhile
+// waits behind at most this many exec payloads.
+#define BULK_BATCH 8
+
+// How often a parent repeats ADOPT until the standby confirms, and when it
+// gives up on the standby and forks a fresh node instead.
+#define ADOPT_RESEND 10
+
+#define ADOPT_TIMEOUT 1000
+
+// A fresh node repeats READY this often until its parent echoes it; the
+// parent stops holding traffic for it after STARTUP_TIMEOUT regardless.
+#define READY_RESEND 5
+
+#define STARTUP_TIMEOUT 5000
+
+// Standbys are forked this long after a node starts, so the fork does not
+// compete with the reply to the create that started it.
+#define STANDBY_DELAY 50
+
+// Exec requests that can be queued for the workers at once; must be a power of two.
+#define WORKER_QUEUE 64
+
+// Exec results a node remembers until told otherwise by a cache command.
+#define CACHE_CAPACITY 256
+
+// Threads started while a guard is alive leave SIGINT and SIGTERM to the
+// main thread, whose handler tears the node or server down.
+struct SignalGuard {
+    sigset_t previous;
+
+    SignalGuard() {
+        sigset_t blocked;
+        sigemptyset(&blocked);
+        for (int sig: {SIGINT, SIGTERM}) {
+            sigaddset(&blocked, sig);
+        }
+        pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    }
+
+    ~SignalGuard() {
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+};
+
+class Client {
+private:
+    using Clock = chrono::steady_clock;
+
+    struct InFlight {
+        bool right;
+        Clock::time_point deadline;
+    };
+
+    // A broadcast PING waiting for the live lists of this node's children.
+    struct Gather {
+        vector<double> live;
+        int pending;
+        Clock::time_point deadline;
+    };
+
+    // Running state of a streamed exec; chunks may be folded out of order
+    // by the workers, so it completes once every received chunk is folded.
+    struct Stream {
+        Accumulator acc;
+        int received;
+        int folded;
+        int total;
+        bool direct;
+        Clock::time_point deadline;
+    };
+
+    // Set once REMOVE_CHILD reaches this node. Children are told first and
+    // the node acknowledges upwards only after they did, or after giving up
+    // on them at the deadline, so a tree comes down leaves first.
+    struct Shutdown {
+        int64_t uniqueIndex;
+        int pending;
+        Clock::time_point deadline;
+    };
+
+    // A pre-forked process parked on an empty child slot. Its sockets are
+    // bound and connected in advance, so adopting it only assigns an id.
+    struct Standby {
+        pid_t pid;
+        Socket *subscriber;
+        Socket *control;
+    };
+
+    // A create request waiting for the standby to confirm its new id.
+    struct Adoption {
+        Message request;
+        bool direct;
+        int64_t uniqueIndex;
+        Clock::time_point resend;
+        Clock::time_point deadline;
+    };
+
+    // A freshly forked child that has not completed the READY handshake.
+    struct Startup {
+        Message request;
+        bool direct;
+        Clock::time_point deadline;
+    };
+
+    // An exec payload handed to a worker, and later its folded result.
+    struct Task {
+        Message *msg = nullptr;
+        bool direct = false;
+        // Cache key of an EXEC_CHILD payload.
+        uint64_t key = 0;
+        Accumulator acc = Accumulator();
+    };
+
+    // This node's share of an exec-all: its own slice plus its children's partials.
+    struct Part {
+        Accumulator acc;
+        int pending;
+        bool own;
+        bool root;
+        int contributors;
+        Clock::time_point deadline;
+    };
+
+    int id;
+    void *context;
+    // False for a threaded node, which shares its host's context.
+    bool ownsContext;
+    // Names this node's endpoints: the pid of a node process, a number
+    // unique within the host for a threaded node.
+    pid_t key;
+    bool terminated;
+    NodeOptions options;
+    unordered_map<int64_t, InFlight> inFlight;
+    unordered_map<int64_t, Gather> gathers;
+    unordered_map<int64_t, Stream> streams;
+    unordered_map<int64_t, Part> parts;
+    // Set while handling a request that arrived over the DEALER.
+    bool replyDirect = false;
+    // Only touched by the I/O thread; workers never see it.
+    ResultCache cache{CACHE_CAPACITY};
+
+    bool shuttingDown = false;
+    Shutdown shutdown{};
+
+    // Indexed by slot: 0 is the left child, 1 the right one.
+    Standby standbys[2]{};
+    unique_ptr<Adoption> adoptions[2];
+    bool standbysDue = false;
+    Clock::time_point standbysAt;
+    unique_ptr<Startup> startups[2];
+    // Frames for a child that is starting or being adopted; its subscription
+    // may not have reached this node's publisher yet.
+    vector<zmq_msg_t> held[2];
+    // Set until the parent has echoed this node's READY on both lanes.
+    bool announcing = false;
+    // Bit per Lane the echo has arrived on.
+    int echoes = 0;
+    Clock::time_point announceAt;
+
+    // Workers only fold payloads; all routing and bookkeeping stays on the
+    // I/O thread, which learns about finished tasks through wakeFd.
+    vector<Message> taskMessages;
+    MPMCQueue<Message *> freeMessages;
+    MPMCQueue<Task> tasks;
+    MPMCQueue<Task> results;
+    vector<thread> workers;
+    sem_t taskReady;
+    int wakeFd;
+    atomic<bool> stopping{false};
+
+    // Slot 0 is this thread's, slot i + 1 belongs to worker i.
+    mutable NodeStats stats;
+
+    StatCounters &counters() const {
+        return stats.slot(0);
+    }
+
+    // Accounts for a message this node encodes and sends itself.
+    void sent(const Message &msg, int copies = 1) const {
+        counters().add(Stat::BYTES_OUT, encodedSize(msg) * copies);
+    }
+
+    void forwarded(zmq_msg_t *frame, Stat direction) const {
+        counters().add(direction);
+        counters().add(Stat::BYTES_OUT, zmq_msg_size(frame));
+    }
+
+    static void foldPayload(const Message &msg, Accumulator &acc) {
+        // An EXEC_PART slice starts after its time budget.
+        int offset = msg.command == CommandType::EXEC_PART ? 1 : 0;
+        size_t n = (size_t) max(msg.size - offset, 0);
+        switch (msg.type) {
+            case PayloadType::FLOAT32:
+                acc.fold(msg.floats + offset, n);
+                break;
+            case PayloadType::INT32:
+                acc.fold(msg.ints + offset, n);
+                break;
+            case PayloadType::INT64:
+                acc.fold(msg.longs + offset, n);
+                break;
+            default:
+                acc.fold(msg.value + offset, n);
+                break;
+        }
+    }
+
+    void workerLoop(int index) {
+        StatCounters &own = stats.slot(index + 1);
+        while (true) {
+            sem_wait(&taskReady);
+            if (stopping) {
+                return;
+            }
+            Task task;
+            if (!tasks.tryPop(task)) {
+                continue;
+            }
+            task.acc = Accumulator((ReduceOp) task.msg->opcode);
+            Clock::time_point start = Clock::now();
+            foldPayload(*task.msg, task.acc);
+            own.add(Stat::COMPUTE_NS, chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+            results.tryPush(task);
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+                continue;
+            }
+        }
+    }
+
+    // Queues the payload for a worker, or folds it right here when there
+    // are no workers or all task slots are taken.
+    void compute(const Message &msg) {
+        counters().add(Stat::EXECS);
+        // Only whole payloads are cached; chunks and slices are parts of
+        // results that are never asked for again.
+        uint64_t key = 0;
+        if (msg.command == CommandType::EXEC_CHILD && cache.enabled()) {
+            key = ResultCache::keyOf(msg);
+            double result;
+            if (cache.find(key, result)) {
+                counters().add(Stat::CACHE_HITS);
+                answerExec(msg, result, replyDirect);
+                return;
+            }
+            counters().add(Stat::CACHE_MISSES);
+        }
+        Message *task = nullptr;
+        if (!workers.empty() && freeMessages.tryPop(task)) {
+            task->command = msg.command;
+            task->toIndex = msg.toIndex;
+            task->createIndex = msg.createIndex;
+            task->uniqueIndex = msg.uniqueIndex;
+            task->flags = msg.flags;
+            task->opcode = msg.opcode;
+            task->size = msg.size;
+            task->type = msg.type;
+            memcpy(task->value, msg.value, msg.size * payloadWidth(msg.type));
+            task->copyTrace(msg);
+            Task queued;
+            queued.msg = task;
+            queued.direct = replyDirect;
+            queued.key = key;
+            tasks.tryPush(queued);
+            sem_post(&taskReady);
+            return;
+        }
+        Accumulator acc((ReduceOp) msg.opcode);
+        Clock::time_point start = Clock::now();
+        foldPayload(msg, acc);
+        counters().add(Stat::COMPUTE_NS, chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+        finishCompute(msg, acc, replyDirect, key);
+    }
+
+    void collectResults() {
+        uint64_t count;
+        if (read(wakeFd, &count, sizeof(count)) != sizeof(count)) {
+            return;
+        }
+        Task task;
+        while (results.tryPop(task)) {
+            finishCompute(*task.msg, task.acc, task.direct, task.key);
+            freeMessages.tryPush(task.msg);
+        }
+    }
+
+    void answerExec(const Message &msg, double value, bool direct) {
+        Message result(CommandType::EXEC_CHILD, SERVER_ID, getId());
+        result.uniqueIndex = msg.uniqueIndex;
+        result.copyTrace(msg);
+        result.value[0] = value;
+        result.size = 1;
+        reply(result, direct);
+    }
+
+    void finishCompute(const Message &msg, const Accumulator &acc, bool direct, uint64_t key) {
+        switch (msg.command) {
+            case CommandType::EXEC_CHILD: {
+                cache.insert(key, acc.result());
+                answerExec(msg, acc.result(), direct);
+                break;
+            }
+            case CommandType::EXEC_CHUNK: {
+                auto it = streams.find(msg.uniqueIndex);
+                if (it == streams.end()) {
+                    break;
+                }
+                Stream &stream = it->second;
+                stream.acc.merge(acc);
+                if (++stream.folded < stream.received || stream.total < 0) {
+                    break;
+                }
+                // A chunk dropped on the way makes the whole result invalid.
+                bool complete = stream.received == stream.total;
+                Message result(complete ? CommandType::EXEC_CHILD : CommandType::ERROR, SERVER_ID, getId());
+                result.uniqueIndex = msg.uniqueIndex;
+                result.copyTrace(msg);
+                result.value[0] = stream.acc.result();
+                result.size = 1;
+                reply(result, stream.direct);
+                streams.erase(it);
+                break;
+            }
+            case CommandType::EXEC_PART: {
+                auto it = parts.find(msg.uniqueIndex);
+                if (it == parts.end()) {
+                    break;
+                }
+                Part &part = it->second;
+                part.acc.merge(acc);
+                part.own = true;
+                ++part.contributors;
+                if (part.pending <= 0) {
+                    finishPart(msg.uniqueIndex, part);
+                    parts.erase(it);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    void replyError(int64_t uniqueIndex) const {
+        Message error;
+        error.uniqueIndex = uniqueIndex;
+        error.toIndex = SERVER_ID;
+        reply(error);
+    }
+
+    void parentFrame(zmq_msg_t *frame, Lane lane) {
+        WireHeader header{};
+        if (!peekHeader(frame, header)) {
+            return;
+        }
+        // A standby ignores everything until its parent adopts it.
+        if (options.standby) {
+            Message msg;
+            if ((CommandType) header.command == CommandType::ADOPT &&
+                decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+                becomeNode(msg);
+            }
+            return;
+        }
+        if ((CommandType) header.command == CommandType::READY) {
+            echoFrom(lane);
+            return;
+        }
+        int64_t receivedNs = header.flags & WIRE_TRACED ? traceClock() : 0;
+        if (header.toIndex == getId() || header.toIndex == UNIVERSAL_MESSAGE) {
+            Message msg;
+            if (decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+                openHop(msg, receivedNs);
+                messageProcessing(msg);
+            }
+            return;
+        }
+        if (header.flags & WIRE_TRACED) {
+            traceFrame(frame, getId(), receivedNs);
+        }
+        // Relayed frames are re-published as received, never decoded.
+        if (header.flags & WIRE_WITHOUT_PROCESSING) {
+            forwarded(frame, Stat::FORWARDED_UP);
+            upLane(laneOf((CommandType) header.command))->sendFrame(frame);
+            return;
+        }
+        bool right = getId() < header.toIndex;
+        // An exec-all slice is given up on by its member's parent once the
+        // budget in the slice runs out; an error from a relay would fail
+        // the whole job instead of leaving the slice out.
+        bool slice = (CommandType) header.command == CommandType::EXEC_PART;
+        if (!(right ? rightSubscriber : leftSubscriber) && !adoptions[right]) {
+            if (!slice) {
+                replyError(header.uniqueIndex);
+            }
+            return;
+        }
+        forwarded(frame, Stat::FORWARDED_DOWN);
+        sendToSlot(right, frame);
+        if (!slice) {
+            inFlight[header.uniqueIndex] = {right, Clock::now() + chrono::milliseconds(CHILD_TIMEOUT)};
+        }
+    }
+
+    void childFrame(zmq_msg_t *frame, bool right, Lane lane) {
+        WireHeader header{};
+        if (!peekHeader(frame, header)) {
+            return;
+        }
+        inFlight.erase(header.uniqueIndex);
+        if ((CommandType) header.command == CommandType::READY) {
+            Message msg;
+            if (decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+                readyFrom(right, msg, lane);
+            }
+            return;
+        }
+        if ((CommandType) header.command == CommandType::PING) {
+            counters().add(Stat::HANDLED);
+            auto it = gathers.find(header.uniqueIndex);
+            if (it == gathers.end()) {
+                return;
+            }
+            Message msg;
+            if (decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+                it->second.live.insert(it->second.live.end(), msg.value, msg.value + msg.size);
+            }
+            // A child's answer is done with its last frame; frames of one
+            // socket arrive in order.
+            if (!(header.flags & WIRE_LAST_CHUNK)) {
+                return;
+            }
+            if (--it->second.pending == 0) {
+                finishGather(header.uniqueIndex, it->second);
+                gathers.erase(it);
+            }
+            return;
+        }
+        if ((CommandType) header.command == CommandType::EXEC_PART && (header.flags & WIRE_PARTIAL)) {
+            counters().add(Stat::HANDLED);
+            Message msg;
+            if (decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+                mergePart(msg);
+            }
+            return;
+        }
+        // Late repeats of an adoption that already completed.
+        if ((CommandType) header.command == CommandType::ADOPT) {
+            return;
+        }
+        if ((CommandType) header.command == CommandType::REMOVE_CHILD && shuttingDown &&
+            header.uniqueIndex == shutdown.uniqueIndex) {
+            if (--shutdown.pending <= 0) {
+                finishShutdown();
+            }
+            return;
+        }
+        if ((CommandType) header.command == CommandType::REMOVE_CHILD && header.toIndex == PARENT_SIGNAL) {
+            Message msg;
+            decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg);
+            msg.toIndex = SERVER_ID;
+            closeSlot(right);
+            sendUp(msg);
+            return;
+        }
+        if (header.flags & WIRE_TRACED) {
+            traceFrame(frame, getId(), traceClock());
+        }
+        forwarded(frame, Stat::FORWARDED_UP);
+        upLane(laneOf((CommandType) header.command))->sendFrame(frame);
+    }
+
+    void closeSlot(bool right) {
+        Socket *&subscriber = right ? rightSubscriber : leftSubscriber;
+        Socket *&control = right ? rightControlSubscriber : leftControlSubscriber;
+        delete subscriber;
+        delete control;
+        subscriber = nullptr;
+        control = nullptr;
+    }
+
+    void directFrame(zmq_msg_t *frame) {
+        int64_t receivedNs = traceClock();
+        Message msg;
+        if (!decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+            return;
+        }
+        openHop(msg, receivedNs);
+        replyDirect = true;
+        try {
+            messageProcessing(msg);
+        } catch (...) {
+            replyDirect = false;
+            throw;
+        }
+        replyDirect = false;
+    }
+
+    // value[0] is the time budget for this subtree's answer, value[1] the
+    // per-hop allowance; every level hands one hop less to its children.
+    void startGather(Message &msg) {
+        int budget = (int) msg.value[0];
+        int hop = (int) msg.value[1];
+        int children = (leftSubscriber != nullptr) + (rightSubscriber != nullptr);
+        Gather gather{{(double) getId()}, children, Clock::now() + chrono::milliseconds(max(budget - hop, 0))};
+        if (!children) {
+            finishGather(msg.uniqueIndex, gather);
+            return;
+        }
+        msg.value[0] = budget - hop;
+        sendDown(msg);
+        gathers[msg.uniqueIndex] = gather;
+    }
+
+    // Subtrees larger than MAX_CAP answer in several frames, numbered like
+    // the chunks of an exec stream.
+    void finishGather(int64_t uniqueIndex, Gather &gather) {
+        size_t sent = 0;
+        int sequence = 0;
+        do {
+            Message msg(CommandType::PING, SERVER_ID, sequence++);
+            msg.uniqueIndex = uniqueIndex;
+            msg.size = (int) min(gather.live.size() - sent, (size_t) MAX_CAP);
+            copy(gather.live.begin() + sent, gather.live.begin() + sent + msg.size, msg.value);
+            sent += msg.size;
+            if (sent == gather.live.size()) {
+                msg.flags |= WIRE_LAST_CHUNK;
+            }
+            sendUp(msg);
+        } while (sent < gather.live.size());
+    }
+
+    // Milliseconds until the closest gather deadline or in-flight sweep.
+    long pollTimeout(Clock::time_point nextSweep) const {
+        bool adopting = adoptions[0] || adoptions[1] || startups[0] || startups[1];
+        if (!needsSweep() && gathers.empty() && parts.empty() && !shuttingDown && !adopting && !standbysDue &&
+            !announcing) {
+            return -1;
+        }
+        Clock::time_point wake = needsSweep() ? nextSweep : Clock::time_point::max();
+        if (standbysDue) {
+            wake = min(wake, standbysAt);
+        }
+        if (announcing) {
+            wake = min(wake, announceAt);
+        }
+        for (const unique_ptr<Startup> &startup: startups) {
+            if (startup) {
+                wake = min(wake, startup->deadline);
+            }
+        }
+        for (const unique_ptr<Adoption> &adoption: adoptions) {
+            if (adoption) {
+                wake = min(wake, adoption->resend);
+            }
+        }
+        if (shuttingDown) {
+            wake = min(wake, shutdown.deadline);
+        }
+        for (auto &gather: gathers) {
+            wake = min(wake, gather.second.deadline);
+        }
+        for (auto &part: parts) {
+            wake = min(wake, part.second.deadline);
+        }
+        return max(0L, (long) chrono::duration_cast<chrono::milliseconds>(wake - Clock::now()).count());
+    }
+
+    // value[0] is the time budget for this subtree, value[1] the per-hop
+    // allowance, as for PING.
+    void startShutdown(Message &msg) {
+        if (shuttingDown) { return; }
+        int budget = msg.size > 0 ? (int) msg.value[0] : 0;
+        int hop = msg.size > 1 ? (int) msg.value[1] : 0;
+        int children = (leftSubscriber != nullptr) + (rightSubscriber != nullptr);
+        shutdown = {msg.uniqueIndex, children, Clock::now() + chrono::milliseconds(max(budget - hop, 0))};
+        shuttingDown = true;
+        if (!children) {
+            finishShutdown();
+        }
+        msg.getToIndex() = UNIVERSAL_MESSAGE;
+        if (msg.size > 0) {
+            msg.value[0] = budget - hop;
+        }
+        sendDown(msg);
+    }
+
+    // Only the acknowledgement still matters, so every other socket drops
+    // what it has queued instead of lingering on it. It goes by the
+    // control lane, which is why parentControlPublisher is not listed.
+    [[noreturn]] void finishShutdown() {
+        Message ack(CommandType::REMOVE_CHILD, SERVER_ID, getId());
+        ack.uniqueIndex = shutdown.uniqueIndex;
+        sendUp(ack);
+        for (Socket *socket: {childPublisherLeft, childPublisherRight, childControlLeft, childControlRight,
+                              parentPublisher, parentSubscriber, parentControlSubscriber, leftSubscriber, rightSubscriber,
+                              leftControlSubscriber, rightControlSubscriber, dealer}) {
+            if (socket) {
+                socket->setLinger(0);
+            }
+        }
+        stop();
+        throw invalid_argument("Exiting child...");
+    }
+
+    void expireAggregations() {
+        Clock::time_point now = Clock::now();
+        if (shuttingDown && shutdown.deadline <= now) {
+            finishShutdown();
+        }
+        if (announcing && announceAt <= now) {
+            announce(false);
+        }
+        for (int slot = 0; slot < 2; ++slot) {
+            if (startups[slot] && startups[slot]->deadline <= now) {
+                finishStartup(slot);
+            }
+        }
+        if (standbysDue && standbysAt <= now) {
+            standbysDue = false;
+            spawnStandbys();
+        }
+        for (int slot = 0; slot < 2; ++slot) {
+            if (!adoptions[slot]) {
+                continue;
+            }
+            if (adoptions[slot]->deadline <= now) {
+                finishAdoption(slot, false);
+            } else if (adoptions[slot]->resend <= now) {
+                sendAdopt(slot);
+            }
+        }
+        for (auto it = gathers.begin(); it != gathers.end();) {
+            if (it->second.deadline <= now) {
+                finishGather(it->first, it->second);
+                it = gathers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto it = parts.begin(); it != parts.end();) {
+            if (it->second.deadline <= now) {
+                finishPart(it->first, it->second);
+                it = parts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void registerChunk(const Message &msg) {
+        auto it = streams.find(msg.uniqueIndex);
+        if (it == streams.end()) {
+            Stream stream{Accumulator((ReduceOp) msg.opcode), 0, 0, -1, replyDirect, {}};
+            it = streams.emplace(msg.uniqueIndex, stream).first;
+        }
+        Stream &stream = it->second;
+        ++stream.received;
+        stream.deadline = Clock::now() + chrono::milliseconds(CHILD_TIMEOUT);
+        if (msg.flags & WIRE_LAST_CHUNK) {
+            stream.total = msg.createIndex + 1;
+        }
+    }
+
+    Part &partFor(const Message &msg) {
+        auto it = parts.find(msg.uniqueIndex);
+        if (it == parts.end()) {
+            int children = (leftSubscriber != nullptr) + (rightSubscriber != nullptr);
+            Part part{Accumulator((ReduceOp) msg.opcode), children, false, false, 0,
+                      Clock::now() + chrono::milliseconds(CHILD_TIMEOUT)};
+            it = parts.emplace(msg.uniqueIndex, part).first;
+        }
+        return it->second;
+    }
+
+    // value[0] is this node's time budget, the rest is its slice;
+    // createIndex names the node the exec-all was rooted at.
+    void registerSlice(const Message &msg) {
+        Part &part = partFor(msg);
+        if (msg.size > 0) {
+            part.deadline = Clock::now() + chrono::milliseconds((int) msg.valueAt(0));
+        }
+        part.root = msg.createIndex == getId();
+    }
+
+    // Partial results travel as (value, compensation, count, contributors).
+    void mergePart(Message &msg) {
+        Part &part = partFor(msg);
+        if (msg.size >= 4) {
+            Accumulator other(part.acc.op);
+            other.value = msg.value[0];
+            other.compensation = msg.value[1];
+            other.count = (int64_t) msg.value[2];
+            part.acc.merge(other);
+            part.contributors += (int) msg.value[3];
+        }
+        if (--part.pending <= 0 && part.own) {
+            finishPart(msg.uniqueIndex, part);
+            parts.erase(msg.uniqueIndex);
+        }
+    }
+
+    void finishPart(int64_t uniqueIndex, Part &part) {
+        Message msg(CommandType::EXEC_PART, SERVER_ID, getId());
+        msg.uniqueIndex = uniqueIndex;
+        msg.opcode = (uint8_t) part.acc.op;
+        msg.value[0] = part.acc.value;
+        msg.value[1] = part.acc.compensation;
+        msg.value[2] = (double) part.acc.count;
+        msg.value[3] = part.contributors;
+        msg.size = 4;
+        if (!part.root) {
+            msg.flags |= WIRE_PARTIAL;
+        }
+        sendUp(msg);
+    }
+
+    bool needsSweep() const {
+        return !inFlight.empty() || !streams.empty();
+    }
+
+    void expireRequests() {
+        Clock::time_point now = Clock::now();
+        for (auto it = streams.begin(); it != streams.end();) {
+            if (it->second.deadline < now) {
+                it = streams.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto it = inFlight.begin(); it != inFlight.end();) {
+            if (it->second.deadline < now) {
+                replyError(it->first);
+                it = inFlight.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Reads up to RECEIVE_BATCH frames without blocking; stops early if the
+    // socket is closed by one of the handlers.
+    template<class Handler>
+    void drain(Socket *&socket, Handler handler, int batch = RECEIVE_BATCH) {
+        Socket *current = socket;
+        zmq_msg_t frame;
+        for (int i = 0; i < batch && socket == current; ++i) {
+            zmq_msg_init(&frame);
+            if (!current->receiveFrame(&frame, ZMQ_DONTWAIT)) {
+                zmq_msg_close(&frame);
+                break;
+            }
+            counters().add(Stat::RECEIVED);
+            counters().add(Stat::BYTES_IN, zmq_msg_size(&frame));
+            handler(&frame);
+            zmq_msg_close(&frame);
+        }
+    }
+
+public:
+    // Bulk lanes keep the original names; see Lane.
+    Socket *childPublisherLeft;
+    Socket *childPublisherRight;
+    Socket *childControlLeft;
+    Socket *childControlRight;
+    Socket *parentPublisher;
+    Socket *parentControlPublisher;
+    Socket *parentSubscriber;
+    Socket *parentControlSubscriber;
+    Socket *leftSubscriber;
+    Socket *rightSubscriber;
+    Socket *leftControlSubscriber;
+    Socket *rightControlSubscriber;
+    Socket *dealer;
+
+    // A threaded node gets its host's context and its key; a node process
+    // creates its own context and goes by its pid.
+    Client(int id, const LinkAddresses &link, const NodeOptions &options, void *sharedContext = nullptr,
+           pid_t threadKey = 0) :
+            id(id), options(options), taskMessages(options.workers ? WORKER_QUEUE : 0),
+            freeMessages(WORKER_QUEUE), tasks(WORKER_QUEUE), results(WORKER_QUEUE), stats(options.workers + 1) {
+        ownsContext = sharedContext == nullptr;
+        context = ownsContext ? createContext() : sharedContext;
+        key = ownsContext ? getpid() : threadKey;
+        string address = createAddress(AddressType::CHILD_PUB_LEFT, key, transport());
+        childPublisherLeft = new Socket(context, SocketType::PUBLISHER, address);
+        address = createAddress(AddressType::CHILD_PUB_RIGHT, key, transport());
+        childPublisherRight = new Socket(context, SocketType::PUBLISHER, address);
+        address = createAddress(AddressType::CHILD_CONTROL_LEFT, key, transport());
+        childControlLeft = new Socket(context, SocketType::PUBLISHER, address);
+        address = createAddress(AddressType::CHILD_CONTROL_RIGHT, key, transport());
+        childControlRight = new Socket(context, SocketType::PUBLISHER, address);
+        parentPublisher = new Socket(context, SocketType::PUBLISHER, link.up, "", SocketRole::CONNECT);
+        parentControlPublisher = new Socket(context, SocketType::PUBLISHER, link.upControl, "", SocketRole::CONNECT);
+        parentSubscriber = new Socket(context, SocketType::SUBSCRIBER, link.down);
+        parentControlSubscriber = new Socket(context, SocketType::SUBSCRIBER, link.downControl);
+        leftSubscriber = nullptr;
+        rightSubscriber = nullptr;
+        leftControlSubscriber = nullptr;
+        rightControlSubscriber = nullptr;
+        dealer = nullptr;
+        // A standby learns its id, and with it its routing id, on adoption;
+        // its parent keeps re-sending ADOPT, so it needs no READY either.
+        if (!options.standby) {
+            connectDealer();
+            announcing = true;
+            announceAt = Clock::now();
+        }
+        terminated = false;
+        startWorkers();
+        scheduleStandbys();
+    }
+
+    void connectDealer() {
+        if (options.router.empty()) {
+            return;
+        }
+        dealer = new Socket(context, SocketType::DEALER, options.router, to_string(id));
+        Message registration(CommandType::REGISTER, SERVER_ID, id);
+        sent(registration);
+        dealer->send(registration);
+    }
+
+    // Without workers there is nothing to signal, which saves two file
+    // descriptors per node.
+    void startWorkers() {
+        wakeFd = -1;
+        if (!options.workers) {
+            return;
+        }
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+        if (wakeFd == -1 || sem_init(&taskReady, 0, 0)) {
+            throw runtime_error("unable to create worker signals");
+        }
+        for (Message &msg: taskMessages) {
+            freeMessages.tryPush(&msg);
+        }
+        SignalGuard guard;
+        for (int i = 0; i < options.workers; ++i) {
+            workers.emplace_back(&Client::workerLoop, this, i);
+        }
+    }
+
+    void stopWorkers() {
+        if (wakeFd == -1) {
+            return;
+        }
+        stopping = true;
+        for (size_t i = 0; i < workers.size(); ++i) {
+            sem_post(&taskReady);
+        }
+        for (thread &worker: workers) {
+            worker.join();
+        }
+        workers.clear();
+        close(wakeFd);
+        sem_destroy(&taskReady);
+    }
+
+    ~Client() {
+        stop();
+    }
+
+    // Closes every socket and the context; safe to call more than once.
+    void stop() {
+        if (terminated) return;
+        terminated = true;
+        stopWorkers();
+        try {
+            for (int slot = 0; slot < 2; ++slot) {
+                adoptions[slot].reset();
+                dropStandby(slot);
+                startups[slot].reset();
+                for (zmq_msg_t &frame: held[slot]) {
+                    zmq_msg_close(&frame);
+                }
+                held[slot].clear();
+            }
+            delete childPublisherLeft;
+            delete childPublisherRight;
+            delete childControlLeft;
+            delete childControlRight;
+            delete parentPublisher;
+            delete parentControlPublisher;
+            delete parentSubscriber;
+            delete parentControlSubscriber;
+            delete leftSubscriber;
+            delete rightSubscriber;
+            delete leftControlSubscriber;
+            delete rightControlSubscriber;
+            delete dealer;
+            if (ownsContext) {
+                destroyContext(context);
+            }
+        } catch (runtime_error &err) {
+            cout << "Server wasn't stopped " << err.what() << endl;
+        }
+    }
+
+    void messageProcessing(Message &msg) {
+        counters().add(Stat::HANDLED);
+        switch (msg.command) {
+            case CommandType::ERROR:
+                throw runtime_error("error message received");
+            case CommandType::RETURN: {
+                msg.getToIndex() = SERVER_ID;
+                reply(msg);
+                break;
+            }
+            case CommandType::CREATE_CHILD: {
+                // A warm standby is answered for once it confirms its id.
+                if (startAdoption(msg)) {
+                    break;
+                }
+                startChild(msg);
+                break;
+            }
+            case CommandType::REMOVE_CHILD: {
+                if (msg.withoutProcessing) {
+                    sendUp(msg);
+                    break;
+                }
+                if (msg.toIndex != getId() && msg.toIndex != UNIVERSAL_MESSAGE) {
+                    sendDown(msg);
+                    break;
+                }
+                startShutdown(msg);
+                break;
+            }
+            case CommandType::EXEC_CHILD:
+            case CommandType::EXEC_CHUNK:
+            case CommandType::EXEC_PART: {
+                if (!validReduceOp(msg.opcode)) {
+                    replyError(msg.uniqueIndex);
+                    break;
+                }
+                if (msg.command == CommandType::EXEC_CHUNK) {
+                    registerChunk(msg);
+                } else if (msg.command == CommandType::EXEC_PART) {
+                    registerSlice(msg);
+                }
+                compute(msg);
+                break;
+            }
+            case CommandType::PING: {
+                startGather(msg);
+                break;
+            }
+            case CommandType::ADOPT: {
+                // A repeat of the request that adopted this node.
+                msg.getToIndex() = SERVER_ID;
+                msg.getCreateIndex() = getId();
+                sendUp(msg);
+                break;
+            }
+            case CommandType::STATS: {
+                msg.getToIndex() = SERVER_ID;
+                msg.getCreateIndex() = getId();
+                stats.snapshot(msg.value);
+                msg.size = (int) Stat::COUNT;
+                reply(msg);
+                break;
+            }
+            // value[0] is the new capacity, or negative to empty the cache;
+            // the reply holds the entries kept and the capacity.
+            case CommandType::CACHE: {
+                if (msg.size > 0 && msg.value[0] < 0) {
+                    cache.clear();
+                } else if (msg.size > 0) {
+                    cache.resize((size_t) msg.value[0]);
+                }
+                msg.getToIndex() = SERVER_ID;
+                msg.getCreateIndex() = getId();
+                msg.value[0] = (double) cache.size();
+                msg.value[1] = (double) cache.getCapacity();
+                msg.size = 2;
+                reply(msg);
+                break;
+            }
+            default:
+                throw runtime_error("undefined command");
+        }
+    }
+
+    // A traced request gets this node's hop on arrival; the hop is closed
+    // when the reply carrying the trace leaves.
+    void openHop(Message &msg, int64_t receivedNs) const {
+        if (msg.flags & WIRE_TRACED) {
+            msg.addHop(getId(), receivedNs, 0);
+        }
+    }
+
+    void closeHop(Message &msg) const {
+        if ((msg.flags & WIRE_TRACED) && msg.traceSize > 0) {
+            TraceHop &hop = msg.trace[msg.traceSize - 1];
+            if (hop.node == getId() && hop.sentNs == 0) {
+                hop.sentNs = traceClock();
+            }
+        }
+    }
+
+    void sendUp(Message &msg) const {
+        closeHop(msg);
+        msg.withoutProcessing = true;
+        sent(msg);
+        upLane(laneOf(msg.command))->send(msg);
+    }
+
+    Socket *upLane(Lane lane) const {
+        return lane == Lane::CONTROL ? parentControlPublisher : parentPublisher;
+    }
+
+    Socket *downLane(int slot, Lane lane) const {
+        if (lane == Lane::CONTROL) {
+            return slot ? childControlRight : childControlLeft;
+        }
+        return slot ? childPublisherRight : childPublisherLeft;
+    }
+
+    // Answers a request on the path it came in by.
+    void reply(Message &msg) const {
+        reply(msg, replyDirect);
+    }
+
+    void reply(Message &msg, bool direct) const {
+        if (direct) {
+            closeHop(msg);
+            msg.withoutProcessing = true;
+            sent(msg);
+            dealer->send(msg);
+        } else {
+            sendUp(msg);
+        }
+    }
+
+    // Encodes once and hands the same refcounted frame to both publishers.
+    void sendDown(Message &msg) {
+        msg.withoutProcessing = false;
+        zmq_msg_t left, right;
+        sent(msg, 2);
+        createMessage(&left, msg);
+        zmq_msg_init(&right);
+        zmq_msg_copy(&right, &left);
+        sendToSlot(0, &left);
+        sendToSlot(1, &right);
+    }
+
+    // Publishes to one child slot, or holds the frame while that child is
+    // still starting; the frame is consumed either way.
+    void sendToSlot(int slot, zmq_msg_t *frame) {
+        if (startups[slot] || adoptions[slot]) {
+            zmq_msg_t copy;
+            zmq_msg_init(&copy);
+            zmq_msg_move(&copy, frame);
+            zmq_msg_close(frame);
+            held[slot].push_back(copy);
+            return;
+        }
+        WireHeader header{};
+        peekHeader(frame, header);
+        downLane(slot, laneOf((CommandType) header.command))->sendFrame(frame);
+    }
+
+    void releaseHeld(int slot) {
+        vector<zmq_msg_t> frames = move(held[slot]);
+        held[slot].clear();
+        for (zmq_msg_t &frame: frames) {
+            sendToSlot(slot, &frame);
+        }
+    }
+
+    int getId() const {
+        return id;
+    }
+
+    Transport transport() const {
+        return options.transport;
+    }
+
+    // A socket a child publishes upwards into; bound before the child
+    // starts, so that it works whichever transport is used.
+    Socket *openInbox() {
+        string address = createAddress(AddressType::CHILD_INBOX, nextKey(), transport());
+        return new Socket(context, SocketType::SUBSCRIBER, address, "", SocketRole::BIND);
+    }
+
+    LinkAddresses childLink(int slot, const Socket *inbox, const Socket *controlInbox) const {
+        return {downLane(slot, Lane::BULK)->getAddress(), downLane(slot, Lane::CONTROL)->getAddress(),
+                inbox->getAddress(), controlInbox->getAddress()};
+    }
+
+    static pid_t nextKey() {
+        static atomic<pid_t> last{0};
+        return ++last;
+    }
+
+    // Threaded nodes still running in this process.
+    static atomic<int> &hosted() {
+        static atomic<int> count{0};
+        return count;
+    }
+
+    // Runs a node on its own detached thread, as main() runs a node process.
+    static void host(int id, const LinkAddresses &link, const NodeOptions &options, void *context, pid_t key) {
+        ++hosted();
+        SignalGuard guard;
+        thread([id, link, options, context, key]() {
+            string pid = to_string(getpid());
+            try {
+                Client client(id, link, options, context, key);
+                cout << pid + ": client " + to_string(id) + " successfully started\n" << flush;
+                client.run();
+            } catch (runtime_error &err) {
+                cout << pid + ": " + err.what() + "\n" << flush;
+            } catch (invalid_argument &inv) {
+                cout << pid + ": " + inv.what() + "\n" << flush;
+            }
+            --hosted();
+        }).detach();
+    }
+
+    bool isStandby() const {
+        return options.standby;
+    }
+
+    void run() {
+        Clock::time_point nextSweep = Clock::now();
+        while (true) {
+            zmq_pollitem_t items[11];
+            Socket *sources[11];
+            int count = 0;
+            // Control lanes come first, so they are served first.
+            for (Socket *socket: {parentControlSubscriber, leftControlSubscriber, rightControlSubscriber,
+                                  standbys[0].control, standbys[1].control, dealer, parentSubscriber,
+                                  leftSubscriber, rightSubscriber}) {
+                if (socket) {
+                    items[count] = {socket->getSocket(), 0, ZMQ_POLLIN, 0};
+                    sources[count++] = socket;
+                }
+            }
+            if (wakeFd != -1) {
+                items[count] = {nullptr, wakeFd, ZMQ_POLLIN, 0};
+                sources[count++] = nullptr;
+            }
+            long timeout = pollTimeout(nextSweep);
+            bool owed = !inFlight.empty() || !gathers.empty() || !parts.empty();
+            Clock::time_point start = Clock::now();
+            int ready = zmq_poll(items, count, timeout);
+            if (owed) {
+                counters().add(Stat::CHILD_WAIT_NS,
+                               chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+            }
+            if (ready == -1) {
+                if (zmq_errno() == EINTR) { continue; }
+                throw runtime_error("poll error");
+            }
+            for (int i = 0; i < count; ++i) {
+                if (!(items[i].revents & ZMQ_POLLIN)) { continue; }
+                if (!sources[i]) {
+                    collectResults();
+                } else if (sources[i] == parentControlSubscriber) {
+                    drain(parentControlSubscriber, [this](zmq_msg_t *frame) { parentFrame(frame, Lane::CONTROL); });
+                } else if (sources[i] == leftControlSubscriber) {
+                    drain(leftControlSubscriber,
+                          [this](zmq_msg_t *frame) { childFrame(frame, false, Lane::CONTROL); });
+                } else if (sources[i] == rightControlSubscriber) {
+                    drain(rightControlSubscriber,
+                          [this](zmq_msg_t *frame) { childFrame(frame, true, Lane::CONTROL); });
+                } else if (sources[i] == standbys[0].control) {
+                    drain(standbys[0].control, [this](zmq_msg_t *frame) { standbyFrame(frame, 0); });
+                } else if (sources[i] == standbys[1].control) {
+                    drain(standbys[1].control, [this](zmq_msg_t *frame) { standbyFrame(frame, 1); });
+                } else if (sources[i] == dealer) {
+                    drain(dealer, [this](zmq_msg_t *frame) { directFrame(frame); });
+                } else if (sources[i] == parentSubscriber) {
+                    drain(parentSubscriber, [this](zmq_msg_t *frame) { parentFrame(frame, Lane::BULK); },
+                          BULK_BATCH);
+                } else if (sources[i] == leftSubscriber) {
+                    drain(leftSubscriber, [this](zmq_msg_t *frame) { childFrame(frame, false, Lane::BULK); },
+                          BULK_BATCH);
+                } else if (sources[i] == rightSubscriber) {
+                    drain(rightSubscriber, [this](zmq_msg_t *frame) { childFrame(frame, true, Lane::BULK); },
+                          BULK_BATCH);
+                }
+            }
+            expireAggregations();
+            if (needsSweep() && Clock::now() >= nextSweep) {
+                expireRequests();
+                nextSweep = Clock::now() + chrono::milliseconds(SWEEP_INTERVAL);
+            }
+        }
+    }
+
+    int addChild(int childId) {
+        int slot = childId < id ? 0 : 1;
+        Socket *&subscriber = slot ? rightSubscriber : leftSubscriber;
+        Socket *&control = slot ? rightControlSubscriber : leftControlSubscriber;
+        subscriber = openInbox();
+        control = openInbox();
+        LinkAddresses link = childLink(slot, subscriber, control);
+        if (options.threaded) {
+            return hostChild(childId, link);
+        }
+        pid_t pid = fork();
+        if (pid == -1) throw runtime_error("fork error");
+        if (!pid) {
+            execClient(childId, link, options);
+        }
+        return pid;
+    }
+
+    // Starts the child on a thread of this process; the create is answered
+    // with the pid of the process, which hosts the whole tree.
+    int hostChild(int childId, const LinkAddresses &link) {
+        host(childId, link, options, context, nextKey());
+        return getpid();
+    }
+
+    // Starting a thread is cheap, so threaded nodes keep no standbys.
+    void scheduleStandbys() {
+        if (options.warm && !options.standby && !options.threaded) {
+            standbysDue = true;
+            standbysAt = Clock::now() + chrono::milliseconds(STANDBY_DELAY);
+        }
+    }
+
+    // Parks a standby on every empty child slot.
+    void spawnStandbys() {
+        for (int slot = 0; slot < 2; ++slot) {
+            if (!standbys[slot].pid && !(slot ? rightSubscriber : leftSubscriber)) {
+                spawnStandby(slot);
+            }
+        }
+    }
+
+    void spawnStandby(int slot) {
+        NodeOptions standbyOptions = options;
+        standbyOptions.standby = true;
+        Socket *inbox = openInbox();
+        Socket *controlInbox = openInbox();
+        LinkAddresses link = childLink(slot, inbox, controlInbox);
+        pid_t pid = fork();
+        if (pid == -1) throw runtime_error("fork error");
+        if (!pid) {
+            execClient(0, link, standbyOptions);
+        }
+        standbys[slot] = {pid, inbox, controlInbox};
+    }
+
+    void dropStandby(int slot) {
+        if (!standbys[slot].pid) {
+            return;
+        }
+        kill(standbys[slot].pid, SIGTERM);
+        delete standbys[slot].subscriber;
+        delete standbys[slot].control;
+        standbys[slot] = {};
+    }
+
+    // Hands the create to the standby on the new child's slot; false if
+    // there is none. ADOPT is repeated until the standby confirms, since
+    // its subscription may still be on the way.
+    bool startAdoption(const Message &msg) {
+        int slot = getId() < msg.createIndex ? 1 : 0;
+        if (!standbys[slot].pid || adoptions[slot]) {
+            return false;
+        }
+        Message adopt(CommandType::ADOPT, UNIVERSAL_MESSAGE, msg.createIndex);
+        Clock::time_point now = Clock::now();
+        adoptions[slot].reset(new Adoption{msg, replyDirect, adopt.uniqueIndex, now,
+                                           now + chrono::milliseconds(ADOPT_TIMEOUT)});
+        sendAdopt(slot);
+        return true;
+    }
+
+    void sendAdopt(int slot) {
+        Adoption &adoption = *adoptions[slot];
+        Message adopt(CommandType::ADOPT, UNIVERSAL_MESSAGE, adoption.request.createIndex);
+        adopt.uniqueIndex = adoption.uniqueIndex;
+        sent(adopt);
+        downLane(slot, Lane::CONTROL)->send(adopt);
+        adoption.resend = Clock::now() + chrono::milliseconds(ADOPT_RESEND);
+    }
+
+    void standbyFrame(zmq_msg_t *frame, int slot) {
+        WireHeader header{};
+        if (peekHeader(frame, header) && (CommandType) header.command == CommandType::ADOPT && adoptions[slot] &&
+            header.uniqueIndex == adoptions[slot]->uniqueIndex) {
+            finishAdoption(slot, true);
+        }
+    }
+
+    // Answers the create: with the standby's pid once it took the id, or
+    // with a freshly forked node if it never confirmed.
+    void finishAdoption(int slot, bool adopted) {
+        unique_ptr<Adoption> adoption = move(adoptions[slot]);
+        Message &msg = adoption->request;
+        if (adopted) {
+            (slot ? rightSubscriber : leftSubscriber) = standbys[slot].subscriber;
+            (slot ? rightControlSubscriber : leftControlSubscriber) = standbys[slot].control;
+            msg.getCreateIndex() = standbys[slot].pid;
+            standbys[slot] = {};
+            msg.getToIndex() = SERVER_ID;
+            reply(msg, adoption->direct);
+            releaseHeld(slot);
+        } else {
+            dropStandby(slot);
+            replyDirect = adoption->direct;
+            startChild(msg);
+            replyDirect = false;
+        }
+    }
+
+    // Forks a node for the create; the create is answered once the READY
+    // handshake shows that messages get through both ways.
+    void startChild(const Message &msg) {
+        int slot = getId() < msg.createIndex ? 1 : 0;
+        unique_ptr<Startup> startup(new Startup{msg, replyDirect,
+                                                Clock::now() + chrono::milliseconds(STARTUP_TIMEOUT)});
+        startup->request.createIndex = addChild(msg.createIndex);
+        startups[slot] = move(startup);
+    }
+
+    // READY with value[0] == 0 asks for an echo on the lane it came by;
+    // value[0] == 1 confirms that the echoes arrived on both lanes. A
+    // child that is slower than STARTUP_TIMEOUT still gets its echoes, or
+    // it would keep asking for the rest of its life.
+    void readyFrom(bool right, const Message &msg, Lane lane) {
+        int slot = right ? 1 : 0;
+        if (msg.size > 0 && msg.value[0] == 1) {
+            if (startups[slot]) {
+                finishStartup(slot);
+            }
+            return;
+        }
+        Message echo(CommandType::READY, UNIVERSAL_MESSAGE, getId());
+        sent(echo);
+        downLane(slot, lane)->send(echo);
+    }
+
+    // The parent heard us on `lane`; once it has on both, one more READY
+    // tells it we heard it too.
+    void echoFrom(Lane lane) {
+        echoes |= 1 << (int) lane;
+        if (announcing && echoes == 3) {
+            announcing = false;
+            announce(true);
+        }
+    }
+
+    // Sends everything held for the child and answers the create. After
+    // STARTUP_TIMEOUT this runs without a handshake, as before it existed.
+    void finishStartup(int slot) {
+        unique_ptr<Startup> startup = move(startups[slot]);
+        releaseHeld(slot);
+        Message &msg = startup->request;
+        msg.getToIndex() = SERVER_ID;
+        reply(msg, startup->direct);
+    }
+
+    // Asks on both lanes, so the parent's echoes prove both of them.
+    void announce(bool heard) {
+        Message msg(CommandType::READY, SERVER_ID, getId());
+        msg.value[0] = heard;
+        msg.size = 1;
+        msg.withoutProcessing = true;
+        sent(msg, heard ? 1 : 2);
+        parentControlPublisher->send(msg);
+        if (!heard) {
+            parentPublisher->send(msg);
+        }
+        announceAt = Clock::now() + chrono::milliseconds(READY_RESEND);
+    }
+
+    // Runs in a standby once its parent assigns it an id.
+    void becomeNode(Message &msg) {
+        id = msg.createIndex;
+        options.standby = false;
+        connectDealer();
+        cout << getpid() << ": client " << id << " successfully started" << endl;
+        msg.getToIndex() = SERVER_ID;
+        sendUp(msg);
+        scheduleStandbys();
+    }
+
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _CORRELATOR_H
+#define _CORRELATOR_H
+
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include "message.h"
+
+using namespace std;
+
+// Matches replies to outstanding requests by Message::uniqueIndex.
+class Correlator {
+private:
+    using Clock = chrono::steady_clock;
+
+    struct Entry {
+        promise<Message> reply;
+        Clock::time_point deadline;
+    };
+
+    mutex lock;
+    unordered_map<int64_t, Entry> pending;
+    Clock::time_point nextSweep;
+
+    // Drops expired entries; their futures report broken_promise.
+    void reap(Clock::time_point now) {
+        if (now < nextSweep) { return; }
+        nextSweep = now + chrono::milliseconds(100);
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second.deadline < now) {
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+public:
+    // Must be called before the request is sent, so a fast reply is not lost.
+    shared_future<Message> expect(int64_t uniqueIndex, chrono::milliseconds timeout) {
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> guard(lock);
+        reap(now);
+        Entry &entry = pending[uniqueIndex];
+        entry.deadline = now + timeout;
+        return entry.reply.get_future().share();
+    }
+
+    // For a request that takes a while to send: the entry never expires
+    // until arm() gives it a timeout.
+    shared_future<Message> expect(int64_t uniqueIndex) {
+        lock_guard<mutex> guard(lock);
+        Entry &entry = pending[uniqueIndex];
+        entry.deadline = Clock::time_point::max();
+        return entry.reply.get_future().share();
+    }
+
+    void arm(int64_t uniqueIndex, chrono::milliseconds timeout) {
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> guard(lock);
+        auto it = pending.find(uniqueIndex);
+        if (it != pending.end()) {
+            it->second.deadline = now + timeout;
+        }
+    }
+
+    // Returns false when nobody waits for this reply (late or unsolicited).
+    // Reaps as well, so expired entries go even while nothing new is sent.
+    bool complete(const Message &msg) {
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> guard(lock);
+        reap(now);
+        auto it = pending.find(msg.uniqueIndex);
+        if (it == pending.end()) {
+            return false;
+        }
+        it->second.reply.set_value(msg);
+        pending.erase(it);
+        return true;
+    }
+
+    void cancel(int64_t uniqueIndex) {
+        lock_guard<mutex> guard(lock);
+        pending.erase(uniqueIndex);
+    }
+};
+
+#endif
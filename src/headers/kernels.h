@@ -0,0 +1,91 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Reduction selected by Message::opcode.
+enum struct ReduceOp : uint8_t {
+    SUM,
+    KAHAN_SUM,
+    MIN,
+    MAX,
+    MEAN,
+    // Payload holds interleaved pairs a0 b0 a1 b1 ..., so any even split works.
+    DOT,
+};
+
+bool parseReduceOp(const string &name, ReduceOp &op);
+
+inline bool validReduceOp(uint8_t op) {
+    return op <= (uint8_t) ReduceOp::DOT;
+}
+
+// Name of the instruction set picked at startup: "avx2", "sse2" or "scalar".
+const char *kernelIsa();
+
+double reduceSum(const double *values, size_t n);
+
+double reduceSum(const float *values, size_t n);
+
+// Adds the compensated sum of `values` into the running (sum, compensation) pair.
+void reduceKahanSum(const double *values, size_t n, double &sum, double &compensation);
+
+void reduceKahanSum(const float *values, size_t n, double &sum, double &compensation);
+
+double reduceMin(const double *values, size_t n);
+
+double reduceMin(const float *values, size_t n);
+
+double reduceMax(const double *values, size_t n);
+
+double reduceMax(const float *values, size_t n);
+
+double reduceDot(const double *pairs, size_t n);
+
+double reduceDot(const float *pairs, size_t n);
+
+// Integer payloads are reduced in 64-bit integers; only the result of a
+// call is widened to double.
+double reduceSum(const int32_t *values, size_t n);
+
+double reduceSum(const int64_t *values, size_t n);
+
+void reduceKahanSum(const int32_t *values, size_t n, double &sum, double &compensation);
+
+void reduceKahanSum(const int64_t *values, size_t n, double &sum, double &compensation);
+
+double reduceMin(const int32_t *values, size_t n);
+
+double reduceMin(const int64_t *values, size_t n);
+
+double reduceMax(const int32_t *values, size_t n);
+
+double reduceMax(const int64_t *values, size_t n);
+
+double reduceDot(const int32_t *pairs, size_t n);
+
+double reduceDot(const int64_t *pairs, size_t n);
+
+// Running state of one reduction, so a result can be built from chunks
+// and from partial results of other nodes.
+struct Accumulator {
+    ReduceOp op;
+    double value;
+    double compensation;
+    int64_t count;
+
+    explicit Accumulator(ReduceOp op = ReduceOp::SUM);
+
+    template<class T>
+    void fold(const T *values, size_t n);
+
+    void merge(const Accumulator &other);
+
+    double result() const;
+};
+
+#endif
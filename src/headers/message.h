@@ -2,8 +2,10 @@
 #define _WRAP_ZMQ_H
 
 #include <tuple>
+#include <string>
 #include <vector>
 #include <atomic>
+#include <cstdint>
 #include "zmq.h"
 
 using namespace std;
@@ -15,6 +17,10 @@ using namespace std;
 enum struct SocketType {
     PUBLISHER,
     SUBSCRIBER,
+    ROUTER,
+    DEALER,
+    PUSH,
+    PULL,
 };
 
 enum struct CommandType {
@@ -23,27 +29,187 @@ enum struct CommandType {
     CREATE_CHILD,
     REMOVE_CHILD,
     EXEC_CHILD,
+    REGISTER,
+    PING,
+    EXEC_CHUNK,
+    EXEC_PART,
+    STATS,
+    ADOPT,
+    READY,
+    CACHE,
+};
+
+// Every link between a node and its parent has two lanes. Exec payloads go
+// over the bulk lane and everything else over the control lane, so probes
+// and creates never queue behind a large payload.
+enum struct Lane {
+    BULK,
+    CONTROL,
+};
+
+inline Lane laneOf(CommandType command) {
+    switch (command) {
+        case CommandType::EXEC_CHILD:
+        case CommandType::EXEC_CHUNK:
+        case CommandType::EXEC_PART:
+            return Lane::BULK;
+        default:
+            return Lane::CONTROL;
+    }
+}
+
+// Kind of endpoint nodes bind; inproc only reaches sockets of the same
+// zmq context, so it needs every node in one process. tcp endpoints get
+// an ephemeral port, and whoever binds one hands its real address on.
+enum struct Transport {
+    IPC,
+    INPROC,
+    TCP,
 };
 
 enum struct AddressType {
     CHILD_PUB_LEFT,
     CHILD_PUB_RIGHT,
-    PARENT_PUB,
+    CHILD_CONTROL_LEFT,
+    CHILD_CONTROL_RIGHT,
+    // Bound by a parent for one child, whose upward publisher connects to it.
+    CHILD_INBOX,
+    SERVER_ROUTER,
+    SERVER_OUTBOX,
 };
 
 #define MAX_CAP 1000
 
+// Element type of a payload. Exec inputs may use any of them; replies and
+// control payloads are always FLOAT64.
+enum struct PayloadType : uint8_t {
+    FLOAT64,
+    FLOAT32,
+    INT32,
+    INT64,
+};
+
+// Wire form of an integer payload. VARINT sends zigzag LEB128 values,
+// DELTA the same for the differences between neighbours.
+enum struct PayloadEncoding : uint8_t {
+    RAW,
+    VARINT,
+    DELTA,
+};
+
+bool parsePayloadType(const string &name, PayloadType &type);
+
+bool parsePayloadEncoding(const string &name, PayloadEncoding &encoding);
+
+inline bool integerPayload(PayloadType type) {
+    return type == PayloadType::INT32 || type == PayloadType::INT64;
+}
+
+// Bytes one value takes in memory and in a RAW payload.
+size_t payloadWidth(PayloadType type);
+
+#define WIRE_VERSION 4
+
+#define WIRE_WITHOUT_PROCESSING 0x01
+
+// Marks the final EXEC_CHUNK of a stream, or the final frame of a PING
+// answer; createIndex holds its sequence number.
+#define WIRE_LAST_CHUNK 0x02
+
+// Marks an EXEC_PART partial result that is still to be merged by the parent.
+#define WIRE_PARTIAL 0x04
+
+// Set in trace mode: the payload is followed by an int32 hop count and
+// that many TraceHop records, one per process the frame went through.
+#define WIRE_TRACED 0x08
+
+#define MAX_TRACE_HOPS 64
+
+// Bits 4-5 of the header flags hold the PayloadType, bits 6-7 the
+// PayloadEncoding; Message keeps them in fields of their own.
+#define WIRE_TYPE_SHIFT 4
+#define WIRE_ENCODING_SHIFT 6
+#define WIRE_PAYLOAD_BITS 0xF0
+
+// Fixed part of every frame, followed by exactly `size` payload values.
+struct WireHeader {
+    uint8_t version;
+    uint8_t command;
+    uint8_t flags;
+    uint8_t opcode;
+    int32_t toIndex;
+    int64_t uniqueIndex;
+    int32_t createIndex;
+    int32_t size;
+};
+
+static_assert(sizeof(WireHeader) == 24, "WireHeader must not be padded");
+
+// Times are nanoseconds of CLOCK_MONOTONIC, which every process on the
+// host shares, so hops recorded by different nodes can be compared.
+struct TraceHop {
+    int32_t node;
+    int32_t reserved;
+    int64_t receivedNs;
+    int64_t sentNs;
+};
+
+static_assert(sizeof(TraceHop) == 24, "TraceHop must not be padded");
+
+#define MAX_FRAME_SIZE (sizeof(WireHeader) + MAX_CAP * sizeof(double) + sizeof(int32_t) + \
+                        MAX_TRACE_HOPS * sizeof(TraceHop))
+
+#define FRAME_POOL_SIZE 64
+
+// Milliseconds a closed socket keeps trying to deliver queued frames.
+#define SOCKET_LINGER 1000
+
+// Applies to every context and socket the process creates afterwards;
+// 0 keeps zmq's default.
+struct SocketTuning {
+    // Both ZMQ_SNDHWM and ZMQ_RCVHWM, in messages.
+    int hwm = 0;
+    // ZMQ_SNDBUF, in bytes.
+    int sndbuf = 0;
+    int ioThreads = 1;
+    // Interface tcp endpoints are bound on, and reached at.
+    string host = "127.0.0.1";
+};
+
+// Milliseconds between attempts to connect to an endpoint that is not bound
+// yet; a parent connects to its child's publisher before the child binds it.
+#define SOCKET_RECONNECT 5
+
 class Message {
 protected:
     static std::atomic<int> counter;
+
+    // Process id in the high half keeps ids unique across the whole tree.
+    static int64_t nextUniqueIndex();
 public:
     CommandType command = CommandType::ERROR;
-    int toIndex;
-    int createIndex;
-    int uniqueIndex;
-    bool withoutProcessing;
+    int toIndex = 0;
+    int createIndex = 0;
+    int64_t uniqueIndex = 0;
+    bool withoutProcessing = false;
+    // WIRE_* flags other than WIRE_WITHOUT_PROCESSING.
+    uint8_t flags = 0;
+    // ReduceOp for exec requests.
+    uint8_t opcode = 0;
     int size = 0;
-    double value[MAX_CAP] = {0};
+    PayloadType type = PayloadType::FLOAT64;
+    // Only applies to integer payloads, and only while it is smaller than RAW.
+    PayloadEncoding encoding = PayloadEncoding::RAW;
+    // Read through the member that matches `type`.
+    union {
+        double value[MAX_CAP] = {0};
+        float floats[MAX_CAP];
+        int32_t ints[MAX_CAP];
+        int64_t longs[MAX_CAP];
+    };
+    // Only sent when WIRE_TRACED is set.
+    int traceSize = 0;
+    TraceHop trace[MAX_TRACE_HOPS];
 
     Message();
 
@@ -63,8 +229,21 @@ public:
 
     int &getToIndex();
 
+    // Payload element `i` whatever the payload type.
+    double valueAt(int i) const;
+
+    void setValue(int i, double v);
+
+    // Drops the hop once the trace is full.
+    void addHop(int node, int64_t receivedNs, int64_t sentNs);
+
+    // Makes this message continue the trace of `other`, if it has one.
+    void copyTrace(const Message &other);
+
 };
 
+void tuneSockets(const SocketTuning &tuning);
+
 void *createContext();
 
 void destroyContext(void *context);
@@ -75,19 +254,40 @@ void *createSocket(void *context, SocketType type);
 
 void closeSocket(void *socket);
 
-string createAddress(AddressType type, pid_t id);
+string createAddress(AddressType type, pid_t id, Transport transport = Transport::IPC);
 
 void bindSocket(void *socket, const string& address);
 
+// The endpoint a socket really bound, with any ephemeral port resolved.
+string boundAddress(void *socket);
+
 void unbindSocket(void *socket, const string& address);
 
 void connectSocket(void *socket, const string& address);
 
 void disconnectSocket(void *socket, const string& address);
 
-void createMessage(zmq_msg_t *zmq_msg, Message &msg);
+size_t encodedSize(const Message &msg);
+
+void encodeMessage(const Message &msg, void *buffer);
+
+bool decodeMessage(const void *buffer, size_t length, Message &msg);
+
+bool peekHeader(zmq_msg_t *frame, WireHeader &header);
+
+int64_t traceClock();
+
+// Replaces a traced frame with a copy that has one more hop appended;
+// relays use it so they never have to decode what they forward.
+void traceFrame(zmq_msg_t *frame, int node, int64_t receivedNs);
+
+void createMessage(zmq_msg_t *zmq_msg, const Message &msg);
+
+void sendFrame(void *socket, zmq_msg_t *frame);
+
+bool receiveFrame(void *socket, zmq_msg_t *frame, int flags = 0);
 
-void sendMessage(void *socket, Message &msg);
+void sendMessage(void *socket, const Message &msg);
 
 Message getMessage(void *socket);
 
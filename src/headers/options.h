@@ -0,0 +1,150 @@
+#ifndef _OPTIONS_H
+#define _OPTIONS_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <csignal>
+#include <unistd.h>
+#include "message.h"
+
+using namespace std;
+
+// Settings shared by every node of a tree. The server parses them from its
+// own command line and each node hands them on to the children it spawns.
+struct NodeOptions {
+    // Endpoint of the server's ROUTER for direct routing, empty if disabled.
+    string router;
+    // Threads folding exec payloads next to the node's I/O loop; 0 folds inline.
+    int workers = 1;
+    // Every node keeps a pre-forked standby process on each empty child slot.
+    bool warm = false;
+    // Set only for such a standby: it has no id until its parent adopts it.
+    bool standby = false;
+    // Nodes run as threads of the server process and talk over inproc.
+    bool threaded = false;
+    // Defaults to inproc when threaded and ipc otherwise.
+    Transport transport = Transport::IPC;
+    // Socket buffers and zmq I/O threads; see SocketTuning.
+    SocketTuning tuning;
+
+    void parse(int argc, char const *argv[], int first) {
+        bool workersGiven = false;
+        bool transportGiven = false;
+        for (int i = first; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg.rfind("--router=", 0) == 0) {
+                router = arg.substr(9);
+            } else if (arg.rfind("--workers=", 0) == 0) {
+                workers = stoi(arg.substr(10));
+                workersGiven = true;
+            } else if (arg == "--warm") {
+                warm = true;
+            } else if (arg == "--standby") {
+                standby = true;
+            } else if (arg == "--threaded") {
+                threaded = true;
+            } else if (arg.rfind("--transport=", 0) == 0) {
+                transport = parseTransport(arg.substr(12));
+                transportGiven = true;
+            } else if (arg.rfind("--host=", 0) == 0) {
+                tuning.host = arg.substr(7);
+            } else if (arg.rfind("--hwm=", 0) == 0) {
+                tuning.hwm = stoi(arg.substr(6));
+            } else if (arg.rfind("--sndbuf=", 0) == 0) {
+                tuning.sndbuf = stoi(arg.substr(9));
+            } else if (arg.rfind("--io-threads=", 0) == 0) {
+                tuning.ioThreads = stoi(arg.substr(13));
+            } else {
+                throw runtime_error("unknown option " + arg);
+            }
+        }
+        // A threaded node is already one thread among many, so it folds
+        // inline unless told otherwise.
+        if (threaded && !workersGiven) {
+            workers = 0;
+        }
+        if (threaded && !transportGiven) {
+            transport = Transport::INPROC;
+        }
+        if (transport == Transport::INPROC && !threaded) {
+            throw runtime_error("inproc transport needs --threaded");
+        }
+    }
+
+    static Transport parseTransport(const string &name) {
+        if (name == "ipc") { return Transport::IPC; }
+        if (name == "tcp") { return Transport::TCP; }
+        if (name == "inproc") { return Transport::INPROC; }
+        throw runtime_error("unknown transport " + name);
+    }
+
+    vector<string> toArgs() const {
+        vector<string> args;
+        if (!router.empty()) {
+            args.push_back("--router=" + router);
+        }
+        if (workers != 1) {
+            args.push_back("--workers=" + to_string(workers));
+        }
+        if (warm) {
+            args.emplace_back("--warm");
+        }
+        if (standby) {
+            args.emplace_back("--standby");
+        }
+        if (threaded) {
+            args.emplace_back("--threaded");
+        }
+        if (transport == Transport::TCP) {
+            args.emplace_back("--transport=tcp");
+        } else if (transport == Transport::INPROC) {
+            args.emplace_back("--transport=inproc");
+        }
+        if (tuning.host != SocketTuning().host) {
+            args.push_back("--host=" + tuning.host);
+        }
+        if (tuning.hwm) {
+            args.push_back("--hwm=" + to_string(tuning.hwm));
+        }
+        if (tuning.sndbuf) {
+            args.push_back("--sndbuf=" + to_string(tuning.sndbuf));
+        }
+        if (tuning.ioThreads != 1) {
+            args.push_back("--io-threads=" + to_string(tuning.ioThreads));
+        }
+        return args;
+    }
+};
+
+// Endpoints of the link between a node and its parent, one of each per
+// lane: the node subscribes to the parent's `down` publishers and
+// publishes into the `up` inboxes the parent bound for it.
+struct LinkAddresses {
+    string down;
+    string downControl;
+    string up;
+    string upControl;
+};
+
+// Replaces the current (freshly forked) process with a node.
+inline void execClient(int id, const LinkAddresses &link, const NodeOptions &options) {
+    vector<string> args = {"client", to_string(id), link.down, link.downControl, link.up, link.upControl};
+    for (string &arg: options.toArgs()) {
+        args.push_back(arg);
+    }
+    vector<char *> argv;
+    for (string &arg: args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    // The fork may come from a thread that blocks SIGINT and SIGTERM (see
+    // SignalGuard); execv keeps that mask, and the node would ignore them.
+    sigset_t empty;
+    sigemptyset(&empty);
+    pthread_sigmask(SIG_SETMASK, &empty, nullptr);
+    execv("client", argv.data());
+    throw runtime_error("execv error");
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Fixed arena of equally sized frames. Frames are handed to zmq through
+// zmq_msg_init_data and come back through release(), which zmq may call
+// from its own I/O thread, so the free list is a tagged lock-free stack.
+class FramePool {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    size_t frameSize;
+    vector<char> arena;
+    vector<atomic<uint32_t>> next;
+    atomic<uint64_t> head;
+
+    static uint64_t pack(uint32_t index, uint32_t tag) {
+        return ((uint64_t) tag << 32) | index;
+    }
+
+    void push(uint32_t index) {
+        uint64_t old = head.load(memory_order_relaxed);
+        uint64_t desired;
+        do {
+            next[index].store((uint32_t) old, memory_order_relaxed);
+            desired = pack(index, (uint32_t) (old >> 32) + 1);
+        } while (!head.compare_exchange_weak(old, desired, memory_order_release, memory_order_relaxed));
+    }
+
+public:
+    FramePool(size_t frameSize, uint32_t count) :
+            frameSize(frameSize), arena(frameSize * count), next(count), head(pack(EMPTY, 0)) {
+        for (uint32_t i = 0; i < count; ++i) {
+            push(i);
+        }
+    }
+
+    FramePool(const FramePool &) = delete;
+
+    FramePool &operator=(const FramePool &) = delete;
+
+    // Returns nullptr when every frame is in flight.
+    void *acquire() {
+        uint64_t old = head.load(memory_order_acquire);
+        while ((uint32_t) old != EMPTY) {
+            uint32_t index = (uint32_t) old;
+            uint64_t desired = pack(next[index].load(memory_order_relaxed), (uint32_t) (old >> 32) + 1);
+            if (head.compare_exchange_weak(old, desired, memory_order_acquire, memory_order_acquire)) {
+                return arena.data() + (size_t) index * frameSize;
+            }
+        }
+        return nullptr;
+    }
+
+    // zmq_free_fn signature: `hint` is the owning pool.
+    static void release(void *data, void *hint) {
+        auto *pool = (FramePool *) hint;
+        pool->push((uint32_t) (((char *) data - pool->arena.data()) / pool->frameSize));
+    }
+
+    size_t getFrameSize() const {
+        return frameSize;
+    }
+};
+
+#endif
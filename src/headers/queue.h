@@ -0,0 +1,84 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+
+using namespace std;
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's design):
+// every cell carries a sequence number telling producers and consumers
+// whose turn it is, so the only shared writes are the two cursors.
+template<class T>
+class MPMCQueue {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    vector<Cell> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos;
+    alignas(64) atomic<size_t> dequeuePos;
+
+public:
+    explicit MPMCQueue(size_t capacity) : cells(capacity), mask(capacity - 1), enqueuePos(0), dequeuePos(0) {
+        if (capacity < 2 || (capacity & mask)) {
+            throw logic_error("queue capacity must be a power of two");
+        }
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    MPMCQueue(const MPMCQueue &) = delete;
+
+    MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+    // Returns false when the queue is full.
+    bool tryPush(const T &value) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.data = value;
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false when the queue is empty.
+    bool tryPop(T &value) {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    value = cell.data;
+                    cell.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif
@@ -6,32 +6,45 @@
 
 using namespace std;
 
+// Which end of a link a socket takes. By default publishers, routers and
+// pulls bind and everything else connects.
+enum struct SocketRole {
+    DEFAULT,
+    BIND,
+    CONNECT,
+};
+
 class Socket {
 public:
-    Socket(void *context, SocketType socketType, const string& address) :
-            socketType(socketType), address(address) {
+    // `identity` is the routing id a DEALER announces to its ROUTER.
+    Socket(void *context, SocketType socketType, const string& address, const string& identity = "",
+           SocketRole role = SocketRole::DEFAULT) :
+            socketType(socketType), role(role), address(address) {
         socket = createSocket(context, socketType);
-        switch (socketType) {
-            case SocketType::PUBLISHER:
-                bindSocket(socket, address);
-                break;
-            case SocketType::SUBSCRIBER:
-                connectSocket(socket, address);
-                break;
-            default:
-                throw logic_error("undefined connection type");
+        if (!identity.empty()) {
+            zmq_setsockopt(socket, ZMQ_ROUTING_ID, identity.data(), identity.size());
+        }
+        if (socketType == SocketType::ROUTER) {
+            int mandatory = 1;
+            zmq_setsockopt(socket, ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+        }
+        if (binds()) {
+            bindSocket(socket, address);
+            // A tcp port is only known once bound.
+            if (address.find('*') != string::npos) {
+                this->address = boundAddress(socket);
+            }
+        } else {
+            connectSocket(socket, address);
         }
     }
 
     ~Socket() {
         try {
-            switch (socketType) {
-                case SocketType::PUBLISHER:
-                    unbindSocket(socket, address);
-                    break;
-                case SocketType::SUBSCRIBER:
-                    disconnectSocket(socket, address);
-                    break;
+            if (binds()) {
+                unbindSocket(socket, address);
+            } else {
+                disconnectSocket(socket, address);
             }
             closeSocket(socket);
         } catch (exception& ex){
@@ -39,22 +52,69 @@ public:
         }
     }
 
-    void send(Message message) {
-        if (socketType == SocketType::PUBLISHER){
+    void send(const Message &message) {
+        if (canSend()){
             sendMessage(socket, message);
         } else {
-            throw logic_error("SUBSCRIBER can't send messages");
+            throw logic_error("this socket type can't send messages");
+        }
+    }
+
+    // Publishes an already encoded frame; the frame is consumed.
+    void sendFrame(zmq_msg_t *frame) {
+        if (canSend()){
+            ::sendFrame(socket, frame);
+        } else {
+            throw logic_error("this socket type can't send messages");
+        }
+    }
+
+    // ROUTER only: addresses the frame to the peer with routing id `identity`.
+    bool sendTo(const string &identity, zmq_msg_t *frame) {
+        if (socketType != SocketType::ROUTER) {
+            throw logic_error("only ROUTER can address peers");
+        }
+        if (zmq_send(socket, identity.data(), identity.size(), ZMQ_SNDMORE) == -1) {
+            return false;
         }
+        return zmq_msg_send(frame, socket, 0) != -1;
     }
 
     Message receive() {
-        if (socketType == SocketType::SUBSCRIBER){
+        if (canReceive()){
             return getMessage(socket);
         } else {
-            throw logic_error("PUBLISHER can't receive messages");
+            throw logic_error("this socket type can't receive messages");
         }
     }
 
+    bool receiveFrame(zmq_msg_t *frame, int flags = 0) {
+        if (canReceive()){
+            return ::receiveFrame(socket, frame, flags);
+        } else {
+            throw logic_error("this socket type can't receive messages");
+        }
+    }
+
+    // ROUTER only: reads the routing id envelope and the frame behind it.
+    bool receiveFrom(string &identity, zmq_msg_t *frame, int flags = 0) {
+        if (socketType != SocketType::ROUTER) {
+            throw logic_error("only ROUTER receives envelopes");
+        }
+        char buffer[256];
+        int size = zmq_recv(socket, buffer, sizeof(buffer), flags);
+        if (size == -1) {
+            return false;
+        }
+        identity.assign(buffer, min(size, (int) sizeof(buffer)));
+        return ::receiveFrame(socket, frame, 0);
+    }
+
+    // Milliseconds a close waits for queued frames; 0 drops them at once.
+    void setLinger(int milliseconds) {
+        zmq_setsockopt(socket, ZMQ_LINGER, &milliseconds, sizeof(milliseconds));
+    }
+
     string getAddress() const {
         return address;
     }
@@ -64,8 +124,25 @@ public:
     }
 
 private:
+    bool binds() const {
+        if (role != SocketRole::DEFAULT) {
+            return role == SocketRole::BIND;
+        }
+        return socketType == SocketType::PUBLISHER || socketType == SocketType::ROUTER ||
+               socketType == SocketType::PULL;
+    }
+
+    bool canSend() const {
+        return socketType != SocketType::SUBSCRIBER && socketType != SocketType::PULL;
+    }
+
+    bool canReceive() const {
+        return socketType != SocketType::PUBLISHER && socketType != SocketType::PUSH;
+    }
+
     void *socket;
     SocketType socketType;
+    SocketRole role;
     string address;
 };
 
@@ -0,0 +1,72 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+using namespace std;
+
+// Slots of a STATS reply, in the order the server prints them.
+enum struct Stat {
+    RECEIVED,
+    FORWARDED_UP,
+    FORWARDED_DOWN,
+    HANDLED,
+    BYTES_IN,
+    BYTES_OUT,
+    EXECS,
+    COMPUTE_NS,
+    // Time the event loop sat in poll while children owed it a reply.
+    CHILD_WAIT_NS,
+    // Exec requests answered from the result cache, and those that missed it.
+    CACHE_HITS,
+    CACHE_MISSES,
+    COUNT,
+};
+
+inline const char *statName(Stat stat) {
+    static const char *names[] = {"received", "forwarded_up", "forwarded_down", "handled", "bytes_in",
+                                  "bytes_out", "execs", "compute_ns", "child_wait_ns",
+                                  "cache_hits", "cache_misses"};
+    return names[(int) stat];
+}
+
+// Counters written by a single thread. Nobody else writes them, so a
+// relaxed load and store is enough and the cache line is never contended;
+// readers on other threads only ever see a slightly stale value.
+struct alignas(64) StatCounters {
+    atomic<uint64_t> values[(int) Stat::COUNT] = {};
+
+    void add(Stat stat, uint64_t n = 1) {
+        atomic<uint64_t> &value = values[(int) stat];
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+};
+
+// One slot per thread of a node; slot 0 belongs to the event loop.
+class NodeStats {
+private:
+    unique_ptr<StatCounters[]> slots;
+    int count;
+
+public:
+    explicit NodeStats(int threads) : slots(new StatCounters[threads]), count(threads) {}
+
+    StatCounters &slot(int thread) {
+        return slots[thread];
+    }
+
+    // Sums every slot into out[0 .. Stat::COUNT).
+    void snapshot(double *out) const {
+        for (int stat = 0; stat < (int) Stat::COUNT; ++stat) {
+            uint64_t total = 0;
+            for (int thread = 0; thread < count; ++thread) {
+                total += slots[thread].values[stat].load(memory_order_relaxed);
+            }
+            out[stat] = (double) total;
+        }
+    }
+};
+
+#endif
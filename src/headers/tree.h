@@ -2,147 +2,230 @@
 #define _TREE_H
 
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <queue>
+#include <memory>
+#include <unordered_map>
 
 using namespace std;
 
-class treeNode {
-private:
-    treeNode *left;
-    treeNode *right;
-    int value;
-
-public:
-    explicit treeNode(int value) : left(nullptr), right(nullptr), value(value) {}
-
-    int &getValue() {
-        return value;
-    }
-
-    treeNode *&getLeft() {
-        return left;
-    }
-
-    treeNode *&getRight() {
-        return right;
-    }
-
-    bool operator<(treeNode &rhs) const {
-        return this->value < rhs.getValue();
-    }
+// Read-only copy of a Tree for threads that must not touch the tree itself.
+// It is never changed once published; every change publishes a new one.
+struct TreeSnapshot {
+    // Sorted.
+    vector<int> ids;
+    int depth = 0;
 
-    bool operator==(treeNode &rhs) const {
-        return this->value == rhs.getValue();
+    bool find(int id) const {
+        return binary_search(ids.begin(), ids.end(), id);
     }
 };
 
+// Mirrors the process tree, so its shape is fixed by the order of inserts
+// and it is never rebalanced: moving a node would mean moving a process.
+// Nodes live in one array and refer to each other by index; every node
+// caches its parent and depth, and the ids are also kept sorted.
 class Tree {
 private:
-    treeNode *root;
-
-    void deleteTree(treeNode *&current) {
-        if (!current) { return; }
-        deleteTree(current->getLeft());
-        deleteTree(current->getRight());
-        delete current;
-        current = nullptr;
-    }
-
-    static void print(treeNode *&current, int h = 0) {
-        if (!current) { return; }
-        print(current->getRight(), h + 2);
-        for (int i = 0; i < h; i++) {
-            cout << "-";
+    struct Node {
+        int value;
+        int left = -1;
+        int right = -1;
+        int parent = -1;
+        // The root has depth 1.
+        int depth = 1;
+    };
+
+    vector<Node> nodes;
+    vector<int> freeSlots;
+    // id -> index into nodes
+    unordered_map<int, int> slots;
+    vector<int> ids;
+    int root = -1;
+    int height = 0;
+
+    int slotOf(int value) const {
+        auto it = slots.find(value);
+        return it == slots.end() ? -1 : it->second;
+    }
+
+    // A new id hangs below its in-order predecessor or successor, whichever
+    // is deeper; one binary search over the sorted ids finds both. Returns
+    // the parent's slot and whether the id becomes its right child.
+    pair<int, bool> placement(int value) const {
+        auto it = lower_bound(ids.begin(), ids.end(), value);
+        int before = it == ids.begin() ? -1 : slotOf(*prev(it));
+        int after = it == ids.end() ? -1 : slotOf(*it);
+        if (before == -1) {
+            return {after, false};
         }
-        cout << current->getValue() << endl;
-        print(current->getLeft(), h + 2);
-    }
-
-    bool find(treeNode *current, int value) {
-        if (!current) { return false; }
-        if (value < current->getValue()) {
-            return find(current->getLeft(), value);
-        } else if (value > current->getValue()) {
-            return find(current->getRight(), value);
-        } else {
-            return true;
+        if (after == -1 || nodes[before].depth > nodes[after].depth) {
+            return {before, true};
         }
+        return {after, false};
     }
 
-    void insert(treeNode *&current, int value) {
-        if (!current) {
-            current = new treeNode(value);
-        } else if (value < current->getValue()) {
-            insert(current->getLeft(), value);
+    int allocate(int value) {
+        int slot;
+        if (freeSlots.empty()) {
+            slot = (int) nodes.size();
+            nodes.push_back(Node{value});
         } else {
-            insert(current->getRight(), value);
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            nodes[slot] = Node{value};
         }
+        slots[value] = slot;
+        return slot;
     }
 
-    void remove(treeNode *&current, int value) {
-        if (!current) { return; }
-        if (value < current->getValue()) {
-            remove(current->getLeft(), value);
-        } else if (value > current->getValue()) {
-            remove(current->getRight(), value);
-        } else {
-            deleteTree(current);
+    // Slots of the subtree under `slot` in pre-order.
+    vector<int> preOrder(int slot) const {
+        vector<int> order, stack;
+        if (slot != -1) {
+            stack.push_back(slot);
         }
-    }
-
-    int getParent(treeNode *&current, int value) {
-        if (value < current->getValue()) {
-            if (!current->getLeft()) {
-                return current->getValue();
+        while (!stack.empty()) {
+            int current = stack.back();
+            stack.pop_back();
+            order.push_back(current);
+            if (nodes[current].right != -1) {
+                stack.push_back(nodes[current].right);
             }
-            return getParent(current->getLeft(), value);
-        } else if (value > current->getValue()) {
-            if (!current->getRight()) {
-                return current->getValue();
+            if (nodes[current].left != -1) {
+                stack.push_back(nodes[current].left);
             }
-            return getParent(current->getRight(), value);
         }
-        return -1;
-    }
-
-    void getAll(treeNode *current, vector<int> &tmp) {
-        if (!current) { return; }
-        getAll(current->getLeft(), tmp);
-        tmp.push_back(current->getValue());
-        getAll(current->getRight(), tmp);
+        return order;
     }
 
 public:
-    Tree() : root(nullptr) {};
-
     void insert(int value) {
-        insert(root, value);
+        if (slotOf(value) != -1) {
+            return;
+        }
+        auto [parent, right] = placement(value);
+        int slot = allocate(value);
+        if (parent == -1) {
+            root = slot;
+        } else {
+            (right ? nodes[parent].right : nodes[parent].left) = slot;
+            nodes[slot].parent = parent;
+            nodes[slot].depth = nodes[parent].depth + 1;
+        }
+        height = max(height, nodes[slot].depth);
+        ids.insert(lower_bound(ids.begin(), ids.end(), value), value);
     }
 
-    bool find(int value) {
-        return find(root, value);
+    bool find(int value) const {
+        return slotOf(value) != -1;
     }
 
-    void print() {
-        print(root);
+    // Largest ids first, indented by depth.
+    void print() const {
+        for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+            cout << string(2 * (nodes[slotOf(*it)].depth - 1), '-') << *it << endl;
+        }
     }
 
+    // Removes `value` with its whole subtree.
     void remove(int value) {
-        remove(root, value);
+        int slot = slotOf(value);
+        if (slot == -1) { return; }
+        int parent = nodes[slot].parent;
+        if (parent == -1) {
+            root = -1;
+        } else {
+            (nodes[parent].left == slot ? nodes[parent].left : nodes[parent].right) = -1;
+        }
+        // A subtree holds a contiguous run of the sorted ids.
+        int low = slot, high = slot;
+        while (nodes[low].left != -1) { low = nodes[low].left; }
+        while (nodes[high].right != -1) { high = nodes[high].right; }
+        ids.erase(lower_bound(ids.begin(), ids.end(), nodes[low].value),
+                  upper_bound(ids.begin(), ids.end(), nodes[high].value));
+        for (int gone: preOrder(slot)) {
+            slots.erase(nodes[gone].value);
+            freeSlots.push_back(gone);
+        }
+        height = 0;
+        for (int id: ids) {
+            height = max(height, nodes[slotOf(id)].depth);
+        }
     }
 
-    int getPlace(int value) {
-        return getParent(root, value);
+    // Where `value` would be attached, or -1 if it is already present or
+    // the tree is empty.
+    int getPlace(int value) const {
+        if (find(value)) { return -1; }
+        int parent = placement(value).first;
+        return parent == -1 ? -1 : nodes[parent].value;
+    }
+
+    // Parent of a present id; -1 for the root or an absent id.
+    int getParent(int value) const {
+        int slot = slotOf(value);
+        if (slot == -1 || nodes[slot].parent == -1) { return -1; }
+        return nodes[nodes[slot].parent].value;
+    }
+
+    // Number of levels; a single node has depth 1.
+    int getDepth() const {
+        return height;
+    }
+
+    // Parents come before their children; empty if `value` is absent.
+    // Each id comes with the height of its own subtree.
+    vector<pair<int, int>> getSubtree(int value) const {
+        vector<int> order = preOrder(slotOf(value));
+        vector<int> heights(nodes.size());
+        vector<pair<int, int>> tmp(order.size());
+        // Children follow their parent in pre-order, so walking backwards
+        // sees every child's height before its parent's.
+        for (size_t i = order.size(); i-- > 0;) {
+            const Node &node = nodes[order[i]];
+            int left = node.left == -1 ? 0 : heights[node.left];
+            int right = node.right == -1 ? 0 : heights[node.right];
+            heights[order[i]] = 1 + max(left, right);
+            tmp[i] = {node.value, heights[order[i]]};
+        }
+        return tmp;
     }
 
-    vector<int> getElements(){
-        vector<int> tmp;
-        getAll(root, tmp);
-        return tmp;
+    // Sorted; stays valid until the next insert or remove.
+    const vector<int> &getIds() const {
+        return ids;
     }
 
-    ~Tree() {
-        deleteTree(root);
+    vector<int> getElements() const {
+        return ids;
+    }
+
+    shared_ptr<const TreeSnapshot> snapshot() const {
+        shared_ptr<TreeSnapshot> view = make_shared<TreeSnapshot>();
+        view->ids = ids;
+        view->depth = height;
+        return view;
+    }
+
+    // Orders sorted, distinct `values` so that inserting them one by one
+    // yields a balanced subtree: medians first, level by level.
+    static vector<int> balancedOrder(const vector<int> &values) {
+        vector<int> order;
+        queue<pair<int, int>> ranges;
+        ranges.push({0, (int) values.size() - 1});
+        while (!ranges.empty()) {
+            auto [low, high] = ranges.front();
+            ranges.pop();
+            if (low > high) { continue; }
+            int middle = low + (high - low) / 2;
+            order.push_back(values[middle]);
+            ranges.push({low, middle - 1});
+            ranges.push({middle + 1, high});
+        }
+        return order;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
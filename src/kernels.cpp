@@ -0,0 +1,492 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "headers/kernels.h"
+
+#if defined(__x86_64__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const double INF = numeric_limits<double>::infinity();
+
+// Neumaier's variant of Kahan summation: also exact when |x| > |sum|.
+static inline void compensatedAdd(double &sum, double &compensation, double x) {
+    double t = sum + x;
+    if (fabs(sum) >= fabs(x)) {
+        compensation += (sum - t) + x;
+    } else {
+        compensation += (x - t) + sum;
+    }
+    sum = t;
+}
+
+// Scalar fallbacks, also used for the tails of the vector loops.
+
+template<class T>
+static double sumScalar(const T *values, size_t n) {
+    double s0 = 0, s1 = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        s0 += values[i];
+        s1 += values[i + 1];
+    }
+    for (; i < n; ++i) {
+        s0 += values[i];
+    }
+    return s0 + s1;
+}
+
+template<class T>
+static void kahanScalar(const T *values, size_t n, double &sum, double &compensation) {
+    for (size_t i = 0; i < n; ++i) {
+        compensatedAdd(sum, compensation, values[i]);
+    }
+}
+
+template<class T>
+static double minScalar(const T *values, size_t n) {
+    double result = INF;
+    for (size_t i = 0; i < n; ++i) {
+        result = min(result, (double) values[i]);
+    }
+    return result;
+}
+
+template<class T>
+static double maxScalar(const T *values, size_t n) {
+    double result = -INF;
+    for (size_t i = 0; i < n; ++i) {
+        result = max(result, (double) values[i]);
+    }
+    return result;
+}
+
+template<class T>
+static double dotScalar(const T *pairs, size_t n) {
+    double result = 0;
+    for (size_t i = 0; i + 2 <= n; i += 2) {
+        result += (double) pairs[i] * pairs[i + 1];
+    }
+    return result;
+}
+
+// Integer kernels are plain loops the compiler vectorizes; the sums are
+// exact as long as they fit in 64 bits.
+
+template<class T>
+static double sumInteger(const T *values, size_t n) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += values[i];
+    }
+    return (double) sum;
+}
+
+template<class T>
+static double minInteger(const T *values, size_t n) {
+    if (!n) { return INF; }
+    T result = values[0];
+    for (size_t i = 1; i < n; ++i) {
+        result = min(result, values[i]);
+    }
+    return (double) result;
+}
+
+template<class T>
+static double maxInteger(const T *values, size_t n) {
+    if (!n) { return -INF; }
+    T result = values[0];
+    for (size_t i = 1; i < n; ++i) {
+        result = max(result, values[i]);
+    }
+    return (double) result;
+}
+
+template<class T>
+static double dotInteger(const T *pairs, size_t n) {
+    int64_t result = 0;
+    for (size_t i = 0; i + 2 <= n; i += 2) {
+        result += (int64_t) pairs[i] * pairs[i + 1];
+    }
+    return (double) result;
+}
+
+#ifdef KERNELS_X86
+
+// SSE2 is part of the x86-64 baseline, so these need no target attribute.
+// Floats are widened to double on load to keep the accumulation exact.
+
+static inline __m128d load2(const double *p) {
+    return _mm_loadu_pd(p);
+}
+
+static inline __m128d load2(const float *p) {
+    return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *) p)));
+}
+
+static inline double lanes2(__m128d v, int which) {
+    return which ? _mm_cvtsd_f64(_mm_unpackhi_pd(v, v)) : _mm_cvtsd_f64(v);
+}
+
+static inline __m128d abs2(__m128d v) {
+    return _mm_andnot_pd(_mm_set1_pd(-0.0), v);
+}
+
+template<class T>
+static double sumSse2(const T *values, size_t n) {
+    __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a0 = _mm_add_pd(a0, load2(values + i));
+        a1 = _mm_add_pd(a1, load2(values + i + 2));
+    }
+    a0 = _mm_add_pd(a0, a1);
+    return lanes2(a0, 0) + lanes2(a0, 1) + sumScalar(values + i, n - i);
+}
+
+template<class T>
+static void kahanSse2(const T *values, size_t n, double &sum, double &compensation) {
+    __m128d s = _mm_setzero_pd(), c = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = load2(values + i);
+        __m128d t = _mm_add_pd(s, x);
+        __m128d larger = _mm_cmpge_pd(abs2(s), abs2(x));
+        __m128d fromSum = _mm_add_pd(_mm_sub_pd(s, t), x);
+        __m128d fromValue = _mm_add_pd(_mm_sub_pd(x, t), s);
+        c = _mm_add_pd(c, _mm_or_pd(_mm_and_pd(larger, fromSum), _mm_andnot_pd(larger, fromValue)));
+        s = t;
+    }
+    for (int lane = 0; lane < 2; ++lane) {
+        compensatedAdd(sum, compensation, lanes2(s, lane));
+        compensation += lanes2(c, lane);
+    }
+    kahanScalar(values + i, n - i, sum, compensation);
+}
+
+template<class T>
+static double minSse2(const T *values, size_t n) {
+    __m128d m = _mm_set1_pd(INF);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        m = _mm_min_pd(m, load2(values + i));
+    }
+    return min(min(lanes2(m, 0), lanes2(m, 1)), minScalar(values + i, n - i));
+}
+
+template<class T>
+static double maxSse2(const T *values, size_t n) {
+    __m128d m = _mm_set1_pd(-INF);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        m = _mm_max_pd(m, load2(values + i));
+    }
+    return max(max(lanes2(m, 0), lanes2(m, 1)), maxScalar(values + i, n - i));
+}
+
+template<class T>
+static double dotSse2(const T *pairs, size_t n) {
+    __m128d acc = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d x = load2(pairs + i), y = load2(pairs + i + 2);
+        acc = _mm_add_pd(acc, _mm_mul_pd(_mm_unpacklo_pd(x, y), _mm_unpackhi_pd(x, y)));
+    }
+    return lanes2(acc, 0) + lanes2(acc, 1) + dotScalar(pairs + i, n - i);
+}
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static inline __m256d load4(const double *p) {
+    return _mm256_loadu_pd(p);
+}
+
+AVX2 static inline __m256d load4(const float *p) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+AVX2 static inline __m256d abs4(__m256d v) {
+    return _mm256_andnot_pd(_mm256_set1_pd(-0.0), v);
+}
+
+AVX2 static inline void store4(__m256d v, double *lanes) {
+    _mm256_storeu_pd(lanes, v);
+}
+
+template<class T>
+AVX2 static double sumAvx2(const T *values, size_t n) {
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_add_pd(a0, load4(values + i));
+        a1 = _mm256_add_pd(a1, load4(values + i + 4));
+    }
+    double lanes[4];
+    store4(_mm256_add_pd(a0, a1), lanes);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sumScalar(values + i, n - i);
+}
+
+template<class T>
+AVX2 static void kahanAvx2(const T *values, size_t n, double &sum, double &compensation) {
+    __m256d s = _mm256_setzero_pd(), c = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = load4(values + i);
+        __m256d t = _mm256_add_pd(s, x);
+        __m256d larger = _mm256_cmp_pd(abs4(s), abs4(x), _CMP_GE_OQ);
+        __m256d fromSum = _mm256_add_pd(_mm256_sub_pd(s, t), x);
+        __m256d fromValue = _mm256_add_pd(_mm256_sub_pd(x, t), s);
+        c = _mm256_add_pd(c, _mm256_blendv_pd(fromValue, fromSum, larger));
+        s = t;
+    }
+    double sums[4], compensations[4];
+    store4(s, sums);
+    store4(c, compensations);
+    for (int lane = 0; lane < 4; ++lane) {
+        compensatedAdd(sum, compensation, sums[lane]);
+        compensation += compensations[lane];
+    }
+    kahanScalar(values + i, n - i, sum, compensation);
+}
+
+template<class T>
+AVX2 static double minAvx2(const T *values, size_t n) {
+    __m256d m = _mm256_set1_pd(INF);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        m = _mm256_min_pd(m, load4(values + i));
+    }
+    double lanes[4];
+    store4(m, lanes);
+    return min(min(min(lanes[0], lanes[1]), min(lanes[2], lanes[3])), minScalar(values + i, n - i));
+}
+
+template<class T>
+AVX2 static double maxAvx2(const T *values, size_t n) {
+    __m256d m = _mm256_set1_pd(-INF);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        m = _mm256_max_pd(m, load4(values + i));
+    }
+    double lanes[4];
+    store4(m, lanes);
+    return max(max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3])), maxScalar(values + i, n - i));
+}
+
+// unpacklo/unpackhi work per 128-bit lane, which still pairs every a_k with b_k.
+template<class T>
+AVX2 static double dotAvx2(const T *pairs, size_t n) {
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d x = load4(pairs + i), y = load4(pairs + i + 4);
+        acc = _mm256_fmadd_pd(_mm256_unpacklo_pd(x, y), _mm256_unpackhi_pd(x, y), acc);
+    }
+    double lanes[4];
+    store4(acc, lanes);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + dotScalar(pairs + i, n - i);
+}
+
+#endif
+
+template<class T>
+struct KernelTable {
+    const char *isa;
+    double (*sum)(const T *, size_t);
+    void (*kahan)(const T *, size_t, double &, double &);
+    double (*min)(const T *, size_t);
+    double (*max)(const T *, size_t);
+    double (*dot)(const T *, size_t);
+};
+
+template<class T>
+static KernelTable<T> selectKernels() {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return {"avx2", sumAvx2<T>, kahanAvx2<T>, minAvx2<T>, maxAvx2<T>, dotAvx2<T>};
+    }
+    return {"sse2", sumSse2<T>, kahanSse2<T>, minSse2<T>, maxSse2<T>, dotSse2<T>};
+#else
+    return {"scalar", sumScalar<T>, kahanScalar<T>, minScalar<T>, maxScalar<T>, dotScalar<T>};
+#endif
+}
+
+static const KernelTable<double> doubleKernels = selectKernels<double>();
+
+static const KernelTable<float> floatKernels = selectKernels<float>();
+
+bool parseReduceOp(const string &name, ReduceOp &op) {
+    static const pair<const char *, ReduceOp> names[] = {
+            {"sum",  ReduceOp::SUM},
+            {"ksum", ReduceOp::KAHAN_SUM},
+            {"min",  ReduceOp::MIN},
+            {"max",  ReduceOp::MAX},
+            {"mean", ReduceOp::MEAN},
+            {"dot",  ReduceOp::DOT},
+    };
+    for (auto &entry: names) {
+        if (name == entry.first) {
+            op = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *kernelIsa() {
+    return doubleKernels.isa;
+}
+
+double reduceSum(const double *values, size_t n) {
+    return doubleKernels.sum(values, n);
+}
+
+double reduceSum(const float *values, size_t n) {
+    return floatKernels.sum(values, n);
+}
+
+void reduceKahanSum(const double *values, size_t n, double &sum, double &compensation) {
+    doubleKernels.kahan(values, n, sum, compensation);
+}
+
+void reduceKahanSum(const float *values, size_t n, double &sum, double &compensation) {
+    floatKernels.kahan(values, n, sum, compensation);
+}
+
+double reduceMin(const double *values, size_t n) {
+    return doubleKernels.min(values, n);
+}
+
+double reduceMin(const float *values, size_t n) {
+    return floatKernels.min(values, n);
+}
+
+double reduceMax(const double *values, size_t n) {
+    return doubleKernels.max(values, n);
+}
+
+double reduceMax(const float *values, size_t n) {
+    return floatKernels.max(values, n);
+}
+
+double reduceDot(const double *pairs, size_t n) {
+    return doubleKernels.dot(pairs, n);
+}
+
+double reduceDot(const float *pairs, size_t n) {
+    return floatKernels.dot(pairs, n);
+}
+
+double reduceSum(const int32_t *values, size_t n) {
+    return sumInteger(values, n);
+}
+
+double reduceSum(const int64_t *values, size_t n) {
+    return sumInteger(values, n);
+}
+
+// An exact integer sum needs no compensation of its own.
+void reduceKahanSum(const int32_t *values, size_t n, double &sum, double &compensation) {
+    compensatedAdd(sum, compensation, sumInteger(values, n));
+}
+
+void reduceKahanSum(const int64_t *values, size_t n, double &sum, double &compensation) {
+    compensatedAdd(sum, compensation, sumInteger(values, n));
+}
+
+double reduceMin(const int32_t *values, size_t n) {
+    return minInteger(values, n);
+}
+
+double reduceMin(const int64_t *values, size_t n) {
+    return minInteger(values, n);
+}
+
+double reduceMax(const int32_t *values, size_t n) {
+    return maxInteger(values, n);
+}
+
+double reduceMax(const int64_t *values, size_t n) {
+    return maxInteger(values, n);
+}
+
+double reduceDot(const int32_t *pairs, size_t n) {
+    return dotInteger(pairs, n);
+}
+
+double reduceDot(const int64_t *pairs, size_t n) {
+    return dotInteger(pairs, n);
+}
+
+Accumulator::Accumulator(ReduceOp op) : op(op), value(0), compensation(0), count(0) {
+    if (op == ReduceOp::MIN) {
+        value = INF;
+    } else if (op == ReduceOp::MAX) {
+        value = -INF;
+    }
+}
+
+template<class T>
+void Accumulator::fold(const T *values, size_t n) {
+    switch (op) {
+        case ReduceOp::SUM:
+        case ReduceOp::MEAN:
+            value += reduceSum(values, n);
+            break;
+        case ReduceOp::KAHAN_SUM:
+            reduceKahanSum(values, n, value, compensation);
+            break;
+        case ReduceOp::MIN:
+            value = min(value, reduceMin(values, n));
+            break;
+        case ReduceOp::MAX:
+            value = max(value, reduceMax(values, n));
+            break;
+        case ReduceOp::DOT:
+            value += reduceDot(values, n);
+            break;
+    }
+    count += (int64_t) n;
+}
+
+template void Accumulator::fold<double>(const double *values, size_t n);
+
+template void Accumulator::fold<float>(const float *values, size_t n);
+
+template void Accumulator::fold<int32_t>(const int32_t *values, size_t n);
+
+template void Accumulator::fold<int64_t>(const int64_t *values, size_t n);
+
+void Accumulator::merge(const Accumulator &other) {
+    switch (op) {
+        case ReduceOp::KAHAN_SUM:
+            compensatedAdd(value, compensation, other.value);
+            compensation += other.compensation;
+            break;
+        case ReduceOp::MIN:
+            value = min(value, other.value);
+            break;
+        case ReduceOp::MAX:
+            value = max(value, other.value);
+            break;
+        default:
+            value += other.value;
+            break;
+    }
+    count += other.count;
+}
+
+double Accumulator::result() const {
+    switch (op) {
+        case ReduceOp::KAHAN_SUM:
+            return value + compensation;
+        case ReduceOp::MEAN:
+            return count ? value / (double) count : 0.0;
+        default:
+            return value;
+    }
+}
@@ -1,21 +1,30 @@
 #include <tuple>
 #include <cstring>
 #include "headers/message.h"
+#include "headers/pool.h"
 #include <unistd.h>
 #include <iostream>
+#include <ctime>
+#include <cerrno>
 
 using namespace std;
 
 atomic<int> Message::counter;
 
+static FramePool framePool(MAX_FRAME_SIZE, FRAME_POOL_SIZE);
+
+int64_t Message::nextUniqueIndex() {
+    return ((int64_t) getpid() << 32) | (uint32_t) counter++;
+}
+
 Message::Message() {
     command = CommandType::ERROR;
-    uniqueIndex = counter++;
+    uniqueIndex = nextUniqueIndex();
     withoutProcessing = false;
 }
 
 Message::Message(CommandType command, int toIndex, int size, const double *value, int createIndex)
-        : command(command), toIndex(toIndex), size(size), uniqueIndex(counter++), withoutProcessing(false),
+        : command(command), toIndex(toIndex), size(size), uniqueIndex(nextUniqueIndex()), withoutProcessing(false),
           createIndex(createIndex) {
     for (int i = 0; i < size; ++i) {
         this->value[i] = value[i];
@@ -23,7 +32,7 @@ Message::Message(CommandType command, int toIndex, int size, const double *value
 }
 
 Message::Message(CommandType command, int toIndex, int createIndex)
-        : command(command), toIndex(toIndex), uniqueIndex(counter++), withoutProcessing(false),
+        : command(command), toIndex(toIndex), uniqueIndex(nextUniqueIndex()), withoutProcessing(false),
           createIndex(createIndex) {}
 
 bool operator==(const Message &lhs, const Message &rhs) {
@@ -39,16 +48,105 @@ int &Message::getToIndex() {
     return toIndex;
 }
 
+double Message::valueAt(int i) const {
+    switch (type) {
+        case PayloadType::FLOAT32:
+            return floats[i];
+        case PayloadType::INT32:
+            return ints[i];
+        case PayloadType::INT64:
+            return (double) longs[i];
+        default:
+            return value[i];
+    }
+}
+
+void Message::setValue(int i, double v) {
+    switch (type) {
+        case PayloadType::FLOAT32:
+            floats[i] = (float) v;
+            break;
+        case PayloadType::INT32:
+            ints[i] = (int32_t) v;
+            break;
+        case PayloadType::INT64:
+            longs[i] = (int64_t) v;
+            break;
+        default:
+            value[i] = v;
+            break;
+    }
+}
+
+bool parsePayloadType(const string &name, PayloadType &type) {
+    static const pair<const char *, PayloadType> names[] = {
+            {"double", PayloadType::FLOAT64},
+            {"float",  PayloadType::FLOAT32},
+            {"int32",  PayloadType::INT32},
+            {"int64",  PayloadType::INT64},
+    };
+    for (auto &entry: names) {
+        if (name == entry.first) {
+            type = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parsePayloadEncoding(const string &name, PayloadEncoding &encoding) {
+    static const pair<const char *, PayloadEncoding> names[] = {
+            {"raw",    PayloadEncoding::RAW},
+            {"varint", PayloadEncoding::VARINT},
+            {"delta",  PayloadEncoding::DELTA},
+    };
+    for (auto &entry: names) {
+        if (name == entry.first) {
+            encoding = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t payloadWidth(PayloadType type) {
+    switch (type) {
+        case PayloadType::FLOAT32:
+        case PayloadType::INT32:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+void Message::addHop(int node, int64_t receivedNs, int64_t sentNs) {
+    if (traceSize < MAX_TRACE_HOPS) {
+        trace[traceSize++] = {node, 0, receivedNs, sentNs};
+    }
+}
+
+void Message::copyTrace(const Message &other) {
+    flags = (flags & ~WIRE_TRACED) | (other.flags & WIRE_TRACED);
+    traceSize = other.traceSize;
+    memcpy(trace, other.trace, traceSize * sizeof(TraceHop));
+}
+
+static SocketTuning tuning;
+
+void tuneSockets(const SocketTuning &newTuning) {
+    tuning = newTuning;
+}
+
 void *createContext() {
     void *context = zmq_ctx_new();
     if (!context) {
         throw runtime_error("unable to create new context");
     }
+    zmq_ctx_set(context, ZMQ_IO_THREADS, tuning.ioThreads);
     return context;
 }
 
 void destroyContext(void *context) {
-    sleep(1);
     if (zmq_ctx_destroy(context)) {
         throw runtime_error("unable to destroy context");
     }
@@ -60,6 +158,14 @@ int getSocketType(SocketType type) {
             return ZMQ_PUB;
         case SocketType::SUBSCRIBER:
             return ZMQ_SUB;
+        case SocketType::ROUTER:
+            return ZMQ_ROUTER;
+        case SocketType::DEALER:
+            return ZMQ_DEALER;
+        case SocketType::PUSH:
+            return ZMQ_PUSH;
+        case SocketType::PULL:
+            return ZMQ_PULL;
         default:
             throw runtime_error("undefined socket type");
     }
@@ -71,24 +177,53 @@ void *createSocket(void *context, SocketType type) {
     if (!socket) {
         throw runtime_error("unable to create socket");
     }
+    // Bounds how long zmq_ctx_destroy waits for frames still queued.
+    int linger = SOCKET_LINGER;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    int reconnect = SOCKET_RECONNECT;
+    zmq_setsockopt(socket, ZMQ_RECONNECT_IVL, &reconnect, sizeof(reconnect));
+    // Subscribers take every frame, whether they bind or connect.
+    if (type == SocketType::SUBSCRIBER) {
+        zmq_setsockopt(socket, ZMQ_SUBSCRIBE, nullptr, 0);
+    }
+    if (tuning.hwm) {
+        zmq_setsockopt(socket, ZMQ_SNDHWM, &tuning.hwm, sizeof(tuning.hwm));
+        zmq_setsockopt(socket, ZMQ_RCVHWM, &tuning.hwm, sizeof(tuning.hwm));
+    }
+    if (tuning.sndbuf) {
+        zmq_setsockopt(socket, ZMQ_SNDBUF, &tuning.sndbuf, sizeof(tuning.sndbuf));
+    }
     return socket;
 }
 
 void closeSocket(void *socket) {
-    sleep(1);
     if (zmq_close(socket)) {
         throw runtime_error("unable to close socket");
     }
 }
 
-string createAddress(AddressType type, pid_t id) {
+// For tcp only the host is fixed; the port is picked when binding.
+string createAddress(AddressType type, pid_t id, Transport transport) {
+    if (transport == Transport::TCP && type != AddressType::SERVER_OUTBOX) {
+        return "tcp://" + tuning.host + ":*";
+    }
+    string scheme = transport == Transport::INPROC ? "inproc://" : "ipc://";
     switch (type) {
-        case AddressType::PARENT_PUB:
-            return "ipc://parent_publisher_" + to_string(id);
+        case AddressType::CHILD_INBOX:
+            // Inboxes are numbered per process; the pid keeps ipc paths apart.
+            return scheme + "child_inbox_" + to_string(getpid()) + "_" + to_string(id);
         case AddressType::CHILD_PUB_LEFT:
-            return "ipc://child_publisher_left_" + to_string(id);
+            return scheme + "child_publisher_left_" + to_string(id);
         case AddressType::CHILD_PUB_RIGHT:
-            return "ipc://child_publisher_right" + to_string(id);
+            return scheme + "child_publisher_right_" + to_string(id);
+        case AddressType::CHILD_CONTROL_LEFT:
+            return scheme + "child_control_left_" + to_string(id);
+        case AddressType::CHILD_CONTROL_RIGHT:
+            return scheme + "child_control_right_" + to_string(id);
+        case AddressType::SERVER_ROUTER:
+            return scheme + "server_router_" + to_string(id);
+        case AddressType::SERVER_OUTBOX:
+            return "inproc://server_outbox_" + to_string(id);
         default:
             throw runtime_error("wrong address type");
     }
@@ -100,8 +235,16 @@ void bindSocket(void *socket, const string& address) {
     }
 }
 
+string boundAddress(void *socket) {
+    char endpoint[256];
+    size_t size = sizeof(endpoint);
+    if (zmq_getsockopt(socket, ZMQ_LAST_ENDPOINT, endpoint, &size)) {
+        throw runtime_error("unable to read bound endpoint");
+    }
+    return string(endpoint);
+}
+
 void unbindSocket(void *socket, const string& address) {
-    sleep(1);
     if (zmq_unbind(socket, address.data())) {
         throw runtime_error("unable to unbind socket");
     }
@@ -111,27 +254,295 @@ void connectSocket(void *socket, const string& address) {
     if (zmq_connect(socket, address.data())) {
         throw runtime_error("unable to connect socket");
     }
-    zmq_setsockopt(socket, ZMQ_SUBSCRIBE, nullptr, 0);
 }
 
+// An inproc peer that already closed takes the connection with it.
 void disconnectSocket(void *socket, const string& address) {
-    if (zmq_disconnect(socket, address.data())) {
+    if (zmq_disconnect(socket, address.data()) && zmq_errno() != ENOENT) {
         throw runtime_error("unable to disconnect socket.");
     }
 }
 
-void createMessage(zmq_msg_t *zmq_msg, Message &msg) {
-    zmq_msg_init_size(zmq_msg, sizeof(msg));
-    memcpy(zmq_msg_data(zmq_msg), &msg, sizeof(msg));
+// Zigzag keeps small negative numbers small once they are unsigned.
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
 }
 
-void sendMessage(void *socket, Message &msg) {
-    zmq_msg_t zmq_msg;
-    createMessage(&zmq_msg, msg);
-    if (!zmq_msg_send(&zmq_msg, socket, 0)) {
+static int64_t unzigzag(uint64_t u) {
+    return (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+}
+
+static size_t varintSize(uint64_t u) {
+    size_t size = 1;
+    while (u >= 0x80) {
+        u >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+static char *putVarint(char *out, uint64_t u) {
+    while (u >= 0x80) {
+        *out++ = (char) (u | 0x80);
+        u >>= 7;
+    }
+    *out++ = (char) u;
+    return out;
+}
+
+// Returns nullptr if the varint runs past `end` or is too long; the tenth
+// byte has room for one bit only.
+static const char *getVarint(const char *in, const char *end, uint64_t &u) {
+    u = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        if (shift == 63 && byte > 1) {
+            return nullptr;
+        }
+        u |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+static int64_t integerAt(const Message &msg, int i) {
+    return msg.type == PayloadType::INT32 ? msg.ints[i] : msg.longs[i];
+}
+
+// Value `i` as it goes on the wire; deltas wrap instead of overflowing.
+static uint64_t wireInteger(const Message &msg, PayloadEncoding encoding, int i) {
+    int64_t v = integerAt(msg, i);
+    if (encoding == PayloadEncoding::DELTA && i > 0) {
+        v = (int64_t) ((uint64_t) v - (uint64_t) integerAt(msg, i - 1));
+    }
+    return zigzag(v);
+}
+
+// The encoding a frame really uses, and the payload bytes it takes.
+static pair<PayloadEncoding, size_t> payloadForm(const Message &msg) {
+    size_t raw = msg.size * payloadWidth(msg.type);
+    if (msg.encoding == PayloadEncoding::RAW || !integerPayload(msg.type)) {
+        return {PayloadEncoding::RAW, raw};
+    }
+    size_t packed = 0;
+    for (int i = 0; i < msg.size && packed < raw; ++i) {
+        packed += varintSize(wireInteger(msg, msg.encoding, i));
+    }
+    if (packed >= raw) {
+        return {PayloadEncoding::RAW, raw};
+    }
+    return {msg.encoding, packed};
+}
+
+// Payload bytes of an encoded frame, or SIZE_MAX if they are malformed.
+static size_t payloadLength(const WireHeader &header, const char *payload, size_t available) {
+    auto type = (PayloadType) ((header.flags >> WIRE_TYPE_SHIFT) & 0x03);
+    auto encoding = (PayloadEncoding) (header.flags >> WIRE_ENCODING_SHIFT);
+    if (header.size < 0 || header.size > MAX_CAP) {
+        return SIZE_MAX;
+    }
+    if (encoding == PayloadEncoding::RAW) {
+        size_t raw = header.size * payloadWidth(type);
+        return raw <= available ? raw : SIZE_MAX;
+    }
+    if (encoding > PayloadEncoding::DELTA || !integerPayload(type)) {
+        return SIZE_MAX;
+    }
+    const char *cursor = payload, *end = payload + available;
+    uint64_t u;
+    for (int i = 0; i < header.size; ++i) {
+        if (!(cursor = getVarint(cursor, end, u))) {
+            return SIZE_MAX;
+        }
+    }
+    return cursor - payload;
+}
+
+size_t encodedSize(const Message &msg) {
+    size_t size = sizeof(WireHeader) + payloadForm(msg).second;
+    if (msg.flags & WIRE_TRACED) {
+        size += sizeof(int32_t) + msg.traceSize * sizeof(TraceHop);
+    }
+    return size;
+}
+
+void encodeMessage(const Message &msg, void *buffer) {
+    WireHeader header{};
+    header.version = WIRE_VERSION;
+    header.command = (uint8_t) msg.command;
+    auto [encoding, payloadSize] = payloadForm(msg);
+    header.flags = msg.flags | (msg.withoutProcessing ? WIRE_WITHOUT_PROCESSING : 0) |
+                   (uint8_t) msg.type << WIRE_TYPE_SHIFT | (uint8_t) encoding << WIRE_ENCODING_SHIFT;
+    header.opcode = msg.opcode;
+    header.toIndex = msg.toIndex;
+    header.createIndex = msg.createIndex;
+    header.uniqueIndex = msg.uniqueIndex;
+    header.size = msg.size;
+    memcpy(buffer, &header, sizeof(header));
+    char *payload = (char *) buffer + sizeof(header);
+    if (encoding == PayloadEncoding::RAW) {
+        memcpy(payload, msg.value, payloadSize);
+    } else {
+        char *out = payload;
+        for (int i = 0; i < msg.size; ++i) {
+            out = putVarint(out, wireInteger(msg, encoding, i));
+        }
+    }
+    if (msg.flags & WIRE_TRACED) {
+        char *section = payload + payloadSize;
+        int32_t hops = msg.traceSize;
+        memcpy(section, &hops, sizeof(hops));
+        memcpy(section + sizeof(hops), msg.trace, hops * sizeof(TraceHop));
+    }
+}
+
+bool decodeMessage(const void *buffer, size_t length, Message &msg) {
+    if (length < sizeof(WireHeader)) {
+        return false;
+    }
+    WireHeader header{};
+    memcpy(&header, buffer, sizeof(header));
+    if (header.version != WIRE_VERSION) {
+        return false;
+    }
+    const char *payload = (const char *) buffer + sizeof(header);
+    size_t payloadSize = payloadLength(header, payload, length - sizeof(header));
+    if (payloadSize == SIZE_MAX) {
+        return false;
+    }
+    auto type = (PayloadType) ((header.flags >> WIRE_TYPE_SHIFT) & 0x03);
+    auto encoding = (PayloadEncoding) (header.flags >> WIRE_ENCODING_SHIFT);
+    size_t payloadEnd = sizeof(header) + payloadSize;
+    int32_t hops = 0;
+    if (header.flags & WIRE_TRACED) {
+        if (length < payloadEnd + sizeof(hops)) {
+            return false;
+        }
+        memcpy(&hops, (const char *) buffer + payloadEnd, sizeof(hops));
+        if (hops < 0 || hops > MAX_TRACE_HOPS ||
+            length != payloadEnd + sizeof(hops) + hops * sizeof(TraceHop)) {
+            return false;
+        }
+    } else if (length != payloadEnd) {
+        return false;
+    }
+    msg.command = (CommandType) header.command;
+    msg.withoutProcessing = header.flags & WIRE_WITHOUT_PROCESSING;
+    msg.flags = header.flags & ~(WIRE_WITHOUT_PROCESSING | WIRE_PAYLOAD_BITS);
+    msg.type = type;
+    msg.encoding = encoding;
+    msg.opcode = header.opcode;
+    msg.toIndex = header.toIndex;
+    msg.createIndex = header.createIndex;
+    msg.uniqueIndex = header.uniqueIndex;
+    msg.size = header.size;
+    if (encoding == PayloadEncoding::RAW) {
+        memcpy(msg.value, payload, payloadSize);
+    } else {
+        // Integers are unpacked into their own type, never widened.
+        const char *cursor = payload;
+        int64_t previous = 0;
+        for (int i = 0; i < header.size; ++i) {
+            uint64_t u;
+            cursor = getVarint(cursor, payload + payloadSize, u);
+            int64_t v = unzigzag(u);
+            if (encoding == PayloadEncoding::DELTA) {
+                v = (int64_t) ((uint64_t) previous + (uint64_t) v);
+                previous = v;
+            }
+            if (type == PayloadType::INT32) {
+                if (v < INT32_MIN || v > INT32_MAX) {
+                    return false;
+                }
+                msg.ints[i] = (int32_t) v;
+            } else {
+                msg.longs[i] = v;
+            }
+        }
+    }
+    msg.traceSize = hops;
+    memcpy(msg.trace, (const char *) buffer + payloadEnd + sizeof(hops), hops * sizeof(TraceHop));
+    return true;
+}
+
+bool peekHeader(zmq_msg_t *frame, WireHeader &header) {
+    if (zmq_msg_size(frame) < sizeof(WireHeader)) {
+        return false;
+    }
+    memcpy(&header, zmq_msg_data(frame), sizeof(header));
+    return header.version == WIRE_VERSION;
+}
+
+int64_t traceClock() {
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1'000'000'000 + now.tv_nsec;
+}
+
+void traceFrame(zmq_msg_t *frame, int node, int64_t receivedNs) {
+    WireHeader header{};
+    if (!peekHeader(frame, header) || !(header.flags & WIRE_TRACED)) {
+        return;
+    }
+    size_t length = zmq_msg_size(frame);
+    size_t payloadSize = payloadLength(header, (char *) zmq_msg_data(frame) + sizeof(header),
+                                       length - sizeof(header));
+    size_t countAt = sizeof(header) + payloadSize;
+    int32_t hops;
+    if (payloadSize == SIZE_MAX || length < countAt + sizeof(hops)) {
+        return;
+    }
+    memcpy(&hops, (char *) zmq_msg_data(frame) + countAt, sizeof(hops));
+    if (hops < 0 || hops >= MAX_TRACE_HOPS || length != countAt + sizeof(hops) + hops * sizeof(TraceHop)) {
+        return;
+    }
+    zmq_msg_t traced;
+    void *buffer = framePool.acquire();
+    if (buffer) {
+        zmq_msg_init_data(&traced, buffer, length + sizeof(TraceHop), FramePool::release, &framePool);
+    } else {
+        zmq_msg_init_size(&traced, length + sizeof(TraceHop));
+    }
+    char *data = (char *) zmq_msg_data(&traced);
+    memcpy(data, zmq_msg_data(frame), length);
+    ++hops;
+    memcpy(data + countAt, &hops, sizeof(hops));
+    TraceHop hop{node, 0, receivedNs, traceClock()};
+    memcpy(data + length, &hop, sizeof(hop));
+    zmq_msg_close(frame);
+    zmq_msg_init(frame);
+    zmq_msg_move(frame, &traced);
+}
+
+void createMessage(zmq_msg_t *zmq_msg, const Message &msg) {
+    size_t size = encodedSize(msg);
+    void *buffer = framePool.acquire();
+    if (!buffer) {
+        zmq_msg_init_size(zmq_msg, size);
+        encodeMessage(msg, zmq_msg_data(zmq_msg));
+        return;
+    }
+    encodeMessage(msg, buffer);
+    zmq_msg_init_data(zmq_msg, buffer, size, FramePool::release, &framePool);
+}
+
+void sendFrame(void *socket, zmq_msg_t *frame) {
+    if (zmq_msg_send(frame, socket, 0) == -1) {
+        zmq_msg_close(frame);
         throw runtime_error("unable to send message");
     }
-    zmq_msg_close(&zmq_msg);
+}
+
+bool receiveFrame(void *socket, zmq_msg_t *frame, int flags) {
+    return zmq_msg_recv(frame, socket, flags) != -1;
+}
+
+void sendMessage(void *socket, const Message &msg) {
+    zmq_msg_t zmq_msg;
+    createMessage(&zmq_msg, msg);
+    sendFrame(socket, &zmq_msg);
 }
 
 Message getMessage(void *socket) {
@@ -141,7 +552,10 @@ Message getMessage(void *socket) {
         return {"error"};
     }
     Message msg;
-    memcpy(&msg, zmq_msg_data(&zmq_msg), sizeof(msg));
+    bool valid = decodeMessage(zmq_msg_data(&zmq_msg), zmq_msg_size(&zmq_msg), msg);
     zmq_msg_close(&zmq_msg);
+    if (!valid) {
+        return {"error"};
+    }
     return msg;
 }
\ No newline at end of file
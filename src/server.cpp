@@ -1,18 +1,81 @@
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <vector>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <set>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <semaphore.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <csignal>
 #include "headers/message.h"
 #include "headers/socket.h"
 #include "headers/tree.h"
+#include "headers/correlator.h"
+#include "headers/options.h"
+#include "headers/kernels.h"
+#include "headers/stats.h"
+#include "headers/queue.h"
+#include "headers/client.h"
 #include "zmq.h"
 
-#define SECOND 1'000'000
+#define CHECK_TIMEOUT 1000
+
+#define JOB_TIMEOUT 10000
+
+// Reported traced jobs kept for `trace`; other jobs go once reported.
+#define TRACE_HISTORY 256
+
+#define POLL_INTERVAL 100
+
+// Replies the receive thread can queue for the dispatcher at once; must be
+// a power of two.
+#define REPLY_QUEUE 64
+
+// Sockets one context may hold in threaded mode, where every node shares
+// the server's; zmq allows 1023 by default.
+#define THREADED_MAX_SOCKETS 65536
+
+// How long a threaded server waits for its node threads to finish.
+#define HOSTED_WAIT 2000
+
+// Time each tree level of an exec-all gets to merge its children's results.
+#define PART_HOP 500
+
+// Time each tree level gets to acknowledge a shutdown before its parent
+// stops waiting for it.
+#define SHUTDOWN_HOP 500
+
+// Largest number of nodes a single create-range or create-batch may add.
+#define MAX_BATCH 4096
+
+// Time each tree level gets to confirm a batch of creates.
+#define BATCH_HOP 1000
+
+// How long the first request waits for node 0 to finish its READY handshake.
+#define ROOT_TIMEOUT 5000
 
 void *receiveFunction(void *server);
 
 void *heartbeatFunction(void *server);
 
+void *dispatchFunction(void *server);
+
+// Server threads leave the termination signals to the main thread, whose
+// handler joins them.
+void startThread(pthread_t &thread, void *(*function)(void *), void *arg) {
+    SignalGuard guard;
+    if (pthread_create(&thread, nullptr, function, arg) != 0) {
+        throw runtime_error("thread create error");
+    }
+}
+
 class Server {
 public:
 
@@ -21,12 +84,166 @@ public:
             int id;
             cin >> id;
             createChild(id);
+        } else if (cmd == "create-range") {
+            int low, high;
+            cin >> low >> high;
+            if (low > high || (long) high - low >= MAX_BATCH) {
+                throw runtime_error("Error: a range must hold 1 to " + to_string(MAX_BATCH) + " ids");
+            }
+            vector<int> ids;
+            for (int id = low; id <= high; ++id) {
+                ids.push_back(id);
+            }
+            cout << createBatch(ids) << endl;
+        } else if (cmd == "create-batch") {
+            string line;
+            getline(cin, line);
+            istringstream in(line);
+            vector<int> ids;
+            int id;
+            while (in >> id) {
+                ids.push_back(id);
+            }
+            if (ids.empty() || ids.size() > MAX_BATCH) {
+                throw runtime_error("Error: a batch must hold 1 to " + to_string(MAX_BATCH) + " ids");
+            }
+            cout << createBatch(ids) << endl;
         } else if (cmd == "exec") {
             int id;
             cin >> id;
             int n;
             cin >> n;
-            execChild(id, n);
+            execChild(id, n, ReduceOp::SUM);
+        } else if (cmd == "reduce") {
+            string name;
+            int id, n;
+            cin >> name >> id >> n;
+            ReduceOp op;
+            if (!parseReduceOp(name, op)) {
+                skipValues(n);
+                throw runtime_error("Error: unknown reduction " + name);
+            }
+            if (op == ReduceOp::DOT && n % 2) {
+                skipValues(n);
+                throw runtime_error("Error: dot expects interleaved pairs");
+            }
+            execChild(id, n, op);
+        } else if (cmd == "exec-all") {
+            int id, n;
+            cin >> id >> n;
+            execAll(id, n, ReduceOp::SUM);
+        } else if (cmd == "reduce-all") {
+            string name;
+            int id, n;
+            cin >> name >> id >> n;
+            ReduceOp op;
+            if (!parseReduceOp(name, op)) {
+                skipValues(n);
+                throw runtime_error("Error: unknown reduction " + name);
+            }
+            execAll(id, n, op);
+        } else if (cmd == "result") {
+            int job;
+            cin >> job;
+            cout << jobResult(job, false) << endl;
+        } else if (cmd == "wait") {
+            string line;
+            getline(cin, line);
+            istringstream ids(line);
+            int job;
+            bool any = false;
+            while (ids >> job) {
+                cout << jobResult(job, true) << endl;
+                any = true;
+            }
+            if (!any) {
+                vector<int> waiting;
+                for (auto &job: jobs) {
+                    if (!job.second.reported) {
+                        waiting.push_back(job.first);
+                    }
+                }
+                for (int id: waiting) {
+                    cout << jobResult(id, true) << endl;
+                }
+            }
+        } else if (cmd == "stats") {
+            string target;
+            cin >> target;
+            vector<int> ids;
+            if (target == "all") {
+                ids = getTree().getElements();
+            } else {
+                int id = stoi(target);
+                if (!getTree().find(id)) {
+                    throw runtime_error("Error: node " + to_string(id) + " doesn't exist");
+                }
+                ids.push_back(id);
+            }
+            for (const string &line: stats(ids)) {
+                cout << line << endl;
+            }
+        } else if (cmd == "cache") {
+            int id;
+            string action;
+            cin >> id >> action;
+            double capacity = -1;
+            if (action == "size") {
+                int size;
+                cin >> size;
+                if (size < 0) {
+                    throw runtime_error("Error: cache size can not be negative");
+                }
+                capacity = size;
+            } else if (action != "clear") {
+                throw runtime_error("Error: unknown cache action " + action);
+            }
+            if (!getTree().find(id)) {
+                throw runtime_error("Error: node " + to_string(id) + " doesn't exist");
+            }
+            cout << cache(id, capacity) << endl;
+        } else if (cmd == "trace") {
+            string arg;
+            cin >> arg;
+            if (arg == "on" || arg == "off") {
+                tracing = arg == "on";
+                cout << "OK" << endl;
+            } else if (arg == "dump") {
+                string path;
+                cin >> path;
+                dumpTraces(path);
+            } else {
+                for (const string &line: traceReport(stoi(arg))) {
+                    cout << line << endl;
+                }
+            }
+        } else if (cmd == "payload") {
+            string line, typeName, encodingName;
+            getline(cin, line);
+            istringstream in(line);
+            in >> typeName >> encodingName;
+            PayloadType type;
+            if (!parsePayloadType(typeName, type)) {
+                throw runtime_error("Error: unknown payload type " + typeName);
+            }
+            PayloadEncoding encoding = integerPayload(type) ? PayloadEncoding::VARINT : PayloadEncoding::RAW;
+            if (!encodingName.empty() && !parsePayloadEncoding(encodingName, encoding)) {
+                throw runtime_error("Error: unknown payload encoding " + encodingName);
+            }
+            if (encoding != PayloadEncoding::RAW && !integerPayload(type)) {
+                throw runtime_error("Error: " + encodingName + " needs an integer payload");
+            }
+            payloadType = type;
+            payloadEncoding = encoding;
+            cout << "OK" << endl;
+        } else if (cmd == "route") {
+            string mode;
+            cin >> mode;
+            if (mode != "direct" && mode != "tree") {
+                throw runtime_error("Error: unknown routing mode " + mode);
+            }
+            directRouting = mode == "direct";
+            cout << "OK" << endl;
         } else if (cmd == "exit") {
             throw invalid_argument("Exiting...");
         } else if (cmd == "heartbeat") {
@@ -47,36 +264,199 @@ public:
         }
     }
 
-    Server() {
+    explicit Server(const NodeOptions &nodeOptions) :
+            replySlots(REPLY_QUEUE), freeReplies(REPLY_QUEUE), replies(REPLY_QUEUE), options(nodeOptions) {
+        tuneSockets(options.tuning);
         context = createContext();
         pid = getpid();
-        string address = createAddress(AddressType::CHILD_PUB_LEFT, pid);
+        if (options.threaded) {
+            hostLimits();
+        }
+        string address = createAddress(AddressType::CHILD_PUB_LEFT, pid, options.transport);
         publisher = new Socket(context, SocketType::PUBLISHER, address);
-        if (pthread_create(&receiveMessage, nullptr, receiveFunction, this) != 0) {
-            throw runtime_error("thread create error");
+        address = createAddress(AddressType::CHILD_CONTROL_LEFT, pid, options.transport);
+        controlPublisher = new Socket(context, SocketType::PUBLISHER, address);
+        address = createAddress(AddressType::SERVER_ROUTER, pid, options.transport);
+        router = new Socket(context, SocketType::ROUTER, address);
+        options.router = router->getAddress();
+        address = createAddress(AddressType::SERVER_OUTBOX, pid);
+        outboxPull = new Socket(context, SocketType::PULL, address);
+        outboxPush = new Socket(context, SocketType::PUSH, address);
+        subscriber = nullptr;
+        controlSubscriber = nullptr;
+        t.insert(0);
+        publishTree();
+        if (sem_init(&replyReady, 0, 0)) {
+            throw runtime_error("unable to create reply signal");
+        }
+        for (Message &msg: replySlots) {
+            freeReplies.tryPush(&msg);
         }
+        dispatching = true;
+        startThread(dispatcher, dispatchFunction, this);
         working = true;
+        startThread(receiveMessage, receiveFunction, this);
     }
 
     ~Server() {
         if (!working) return;
+        bool acknowledged = shutdown();
+        if (!acknowledged) {
+            cout << "Shutdown wasn't acknowledged by every node" << endl;
+        }
         working = false;
-        send(Message(CommandType::REMOVE_CHILD, 0, 0));
+        pthread_join(receiveMessage, nullptr);
+        dispatching = false;
+        sem_post(&replyReady);
+        pthread_join(dispatcher, nullptr);
+        sem_destroy(&replyReady);
+        // With the tree gone nothing queued can be delivered any more.
+        if (acknowledged) {
+            for (Socket *socket: {publisher, controlPublisher, subscriber, controlSubscriber, router, outboxPush,
+                                  outboxPull}) {
+                if (socket) {
+                    socket->setLinger(0);
+                }
+            }
+        }
+        // Threaded nodes use the context too; whatever is still running
+        // after this sees ETERM and closes its sockets, which
+        // destroyContext waits for.
+        auto hostedDeadline = chrono::steady_clock::now() + chrono::milliseconds(HOSTED_WAIT);
+        while (Client::hosted() > 0 && chrono::steady_clock::now() < hostedDeadline) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
         try {
             delete publisher;
+            delete controlPublisher;
             delete subscriber;
+            delete controlSubscriber;
+            delete router;
+            delete outboxPush;
+            delete outboxPull;
             publisher = nullptr;
+            controlPublisher = nullptr;
             subscriber = nullptr;
+            controlSubscriber = nullptr;
             destroyContext(context);
-            usleep(7.5 * SECOND);
         } catch (runtime_error &err) {
             cout << "Server wasn't stopped " << err.what() << endl;
         }
     }
 
-    void send(Message msg) {
-        msg.withoutProcessing = false;
-        publisher->send(msg);
+    // Requests to registered nodes go straight over the ROUTER in direct
+    // mode; removal and broadcasts always walk the tree.
+    void send(const Message &msg) {
+        awaitRoot();
+        lock_guard<mutex> guard(sendLock);
+        if (directRouting && isRoutable(msg)) {
+            outboxPush->send(msg);
+        } else {
+            (laneOf(msg.command) == Lane::CONTROL ? controlPublisher : publisher)->send(msg);
+        }
+    }
+
+    // Until node 0 has confirmed READY its subscription may not be in place
+    // yet, and anything published would be dropped.
+    void awaitRoot() {
+        if (rootWaited) {
+            return;
+        }
+        rootReadyFuture.wait_for(chrono::milliseconds(ROOT_TIMEOUT));
+        rootWaited = true;
+    }
+
+    bool isRoutable(const Message &msg) {
+        if (msg.command == CommandType::REMOVE_CHILD || msg.toIndex < 0) {
+            return false;
+        }
+        {
+            lock_guard<mutex> guard(routeLock);
+            if (!routable.count(msg.toIndex)) {
+                return false;
+            }
+        }
+        return treeView()->find(msg.toIndex);
+    }
+
+    // Node 0 runs the same READY handshake with the server as every other
+    // node does with its parent, echoed on the lane it came by. Handled on
+    // the receive thread, which alone knows the lane.
+    bool readyFrame(zmq_msg_t *frame, Lane lane) {
+        WireHeader header{};
+        Message msg;
+        if (!peekHeader(frame, header) || (CommandType) header.command != CommandType::READY ||
+            !decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+            return false;
+        }
+        if (msg.size > 0 && msg.value[0] == 1) {
+            if (!rootAnnounced.exchange(true)) {
+                rootReady.set_value();
+            }
+        } else {
+            lock_guard<mutex> guard(sendLock);
+            (lane == Lane::CONTROL ? controlPublisher : publisher)
+                    ->send(Message(CommandType::READY, UNIVERSAL_MESSAGE, SERVER_ID));
+        }
+        return true;
+    }
+
+    // Receive thread: queues the reply for the dispatcher, or handles it
+    // right here when every reply slot is taken.
+    void dispatch(zmq_msg_t *frame) {
+        Message *slot = nullptr;
+        if (!freeReplies.tryPop(slot)) {
+            Message msg;
+            if (decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), msg)) {
+                handleReply(msg);
+            }
+            return;
+        }
+        if (!decodeMessage(zmq_msg_data(frame), zmq_msg_size(frame), *slot)) {
+            freeReplies.tryPush(slot);
+            return;
+        }
+        replies.tryPush(slot);
+        sem_post(&replyReady);
+    }
+
+    // Dispatcher thread: completes replies in the order they arrived, so
+    // printing and waking waiters never holds up the receive thread.
+    void dispatchReplies() {
+        while (true) {
+            sem_wait(&replyReady);
+            Message *msg;
+            if (!replies.tryPop(msg)) {
+                if (!dispatching) {
+                    return;
+                }
+                continue;
+            }
+            handleReply(*msg);
+            freeReplies.tryPush(msg);
+        }
+    }
+
+    // Runs on the dispatcher for every reply, whichever way it came; on the
+    // receive thread as well when the reply queue is full.
+    void handleReply(Message &msg) {
+        if (msg.flags & WIRE_TRACED) {
+            int64_t now = traceClock();
+            msg.addHop(SERVER_ID, now, now);
+        }
+        if (msg.command == CommandType::REGISTER) {
+            lock_guard<mutex> guard(routeLock);
+            routable.insert(msg.createIndex);
+            return;
+        }
+        if (msg.command == CommandType::PING && !sweepFrame(msg)) {
+            return;
+        }
+        bool awaited = correlator.complete(msg);
+        // Batch creates are confirmed together by createBatch.
+        if (msg.command == CommandType::CREATE_CHILD && !awaited) {
+            cout << "OK: " << msg.getCreateIndex() << endl;
+        }
     }
 
     void createChild(int id) {
@@ -88,43 +468,434 @@ public:
         }
         send(Message(CommandType::CREATE_CHILD, t.getPlace(id), id));
         t.insert(id);
+        publishTree();
+    }
+
+    // Sends every create before waiting for any. A parent holds the creates
+    // for its future subtree until its new child is up, so the whole batch
+    // travels in one pass and sibling subtrees fork concurrently. Parents
+    // that existed before the batch are checked once each.
+    string createBatch(vector<int> ids) {
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        vector<int> failed;
+        vector<pair<int, int>> creates;
+        set<int> added;
+        map<int, bool> available;
+        for (int id: Tree::balancedOrder(ids)) {
+            if (t.find(id)) {
+                failed.push_back(id);
+                continue;
+            }
+            int parent = t.getPlace(id);
+            if (parent && !added.count(parent)) {
+                auto it = available.find(parent);
+                if (it == available.end()) {
+                    it = available.emplace(parent, check(parent)).first;
+                }
+                if (!it->second) {
+                    failed.push_back(id);
+                    continue;
+                }
+            }
+            creates.emplace_back(parent, id);
+            t.insert(id);
+            added.insert(id);
+        }
+        chrono::milliseconds timeout(BATCH_HOP * t.getDepth());
+        vector<shared_future<Message>> replies;
+        for (auto [parent, id]: creates) {
+            Message msg(CommandType::CREATE_CHILD, parent, id);
+            replies.push_back(correlator.expect(msg.uniqueIndex, timeout));
+            send(msg);
+        }
+        auto deadline = chrono::steady_clock::now() + timeout;
+        set<int> unconfirmed;
+        for (size_t i = 0; i < creates.size(); ++i) {
+            bool ok = false;
+            if (replies[i].wait_until(deadline) == future_status::ready) {
+                try {
+                    ok = replies[i].get().command == CommandType::CREATE_CHILD;
+                } catch (future_error &) {}
+            }
+            if (!ok) {
+                unconfirmed.insert(creates[i].second);
+            }
+        }
+        // A node that never confirmed can not be a parent, and its id must
+        // stay free for a retry; whatever was placed below it goes too.
+        for (int id: unconfirmed) {
+            for (auto [gone, height]: t.getSubtree(id)) {
+                if (!unconfirmed.count(gone)) {
+                    failed.push_back(gone);
+                }
+            }
+            t.remove(id);
+        }
+        failed.insert(failed.end(), unconfirmed.begin(), unconfirmed.end());
+        // Other threads only see the batch once it is confirmed, so a
+        // heartbeat does not report nodes that are still starting.
+        publishTree();
+        int created = (int) ids.size() - (int) failed.size();
+        if (failed.empty()) {
+            return "OK: created " + to_string(created) + " nodes";
+        }
+        sort(failed.begin(), failed.end());
+        string line = "Error: created " + to_string(created) + " of " + to_string(ids.size()) + " nodes; failed:";
+        for (int id: failed) {
+            line += " " + to_string(id);
+        }
+        return line;
+    }
+
+    // Reads the next input value in the payload type of `msg`.
+    static void readValue(Message &msg) {
+        switch (msg.type) {
+            case PayloadType::FLOAT32:
+                cin >> msg.floats[msg.size];
+                break;
+            case PayloadType::INT32:
+                cin >> msg.ints[msg.size];
+                break;
+            case PayloadType::INT64:
+                cin >> msg.longs[msg.size];
+                break;
+            default:
+                cin >> msg.value[msg.size];
+                break;
+        }
+        ++msg.size;
     }
 
-    void execChild(int id, int n) {
-        double nums[n];
+    void typePayload(Message &msg) const {
+        msg.type = payloadType;
+        msg.encoding = payloadEncoding;
+    }
+
+    // Consumes the operands of a rejected command.
+    static void skipValues(int n) {
+        string cur;
         for (int i = 0; i < n; ++i) {
-            int cur;
             cin >> cur;
-            nums[i] = cur;
         }
+    }
+
+    // Inputs larger than MAX_CAP are streamed as EXEC_CHUNK messages while
+    // they are read, so memory use does not depend on n.
+    void execChild(int id, int n, ReduceOp op) {
         if (!t.find(id)) {
+            skipValues(n);
+            throw runtime_error("Error: node " + to_string(id) + " doesn't exist");
+        }
+        bool streaming = n > MAX_CAP;
+        Message msg(streaming ? CommandType::EXEC_CHUNK : CommandType::EXEC_CHILD, id, 0);
+        msg.opcode = (uint8_t) op;
+        typePayload(msg);
+        Job &job = jobs[nextJob];
+        job.node = id;
+        job.traced = tracing;
+        expectJob(job, msg.uniqueIndex);
+        int sequence = 0;
+        for (int i = 0; i < n; ++i) {
+            readValue(msg);
+            if (msg.size == MAX_CAP && i + 1 < n) {
+                msg.createIndex = sequence++;
+                stamp(msg, job.traced);
+                send(msg);
+                msg.size = 0;
+            }
+        }
+        if (streaming) {
+            msg.createIndex = sequence;
+            msg.flags |= WIRE_LAST_CHUNK;
+        }
+        stamp(msg, job.traced);
+        send(msg);
+        armJob(job, chrono::milliseconds(JOB_TIMEOUT));
+        cout << "OK: job " << nextJob++ << endl;
+    }
+
+    // Starts a fresh trace at the server; every chunk of a stream gets its own.
+    static void stamp(Message &msg, bool traced) {
+        if (!traced) { return; }
+        int64_t now = traceClock();
+        msg.flags |= WIRE_TRACED;
+        msg.traceSize = 0;
+        msg.addHop(SERVER_ID, now, now);
+    }
+
+    static string hopName(int node) {
+        return node == SERVER_ID ? "server" : "node " + to_string(node);
+    }
+
+    // Time between hops is the link, time within a hop the node's own work;
+    // a streamed exec reports the path of its last chunk.
+    vector<string> traceReport(int id) {
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            throw runtime_error("Error: job " + to_string(id) + " doesn't exist");
+        }
+        const Message *reply = tracedReply(it->second);
+        if (!reply) {
+            throw runtime_error("Error: job " + to_string(id) + " has no trace");
+        }
+        const TraceHop *hops = reply->trace;
+        int count = reply->traceSize;
+        ostringstream out;
+        out << "OK: job " << id << ": " << (hops[count - 1].receivedNs - hops[0].sentNs) / 1000.0 << " us over "
+            << count << " hops";
+        vector<string> lines = {out.str()};
+        for (int i = 0; i < count; ++i) {
+            if (i > 0) {
+                ostringstream link;
+                link << "  " << hopName(hops[i - 1].node) << " -> " << hopName(hops[i].node) << ": "
+                     << (hops[i].receivedNs - hops[i - 1].sentNs) / 1000.0 << " us";
+                lines.push_back(link.str());
+            }
+            if (hops[i].sentNs > hops[i].receivedNs) {
+                ostringstream stay;
+                stay << "  " << hopName(hops[i].node) << ": " << (hops[i].sentNs - hops[i].receivedNs) / 1000.0
+                     << " us";
+                lines.push_back(stay.str());
+            }
+        }
+        return lines;
+    }
+
+    // Chrome trace-event format: one process per job, one thread per node,
+    // complete ("X") events for the time spent in nodes and on links.
+    void dumpTraces(const string &path) {
+        ofstream out(path);
+        if (!out) {
+            throw runtime_error("Error: can not open " + path);
+        }
+        out << fixed << setprecision(3) << "{\"traceEvents\": [";
+        bool first = true;
+        int dumped = 0;
+        auto event = [&](const string &name, const char *category, int job, int node, int64_t from, int64_t to) {
+            out << (first ? "" : ",") << "\n  {\"name\": \"" << name << "\", \"cat\": \"" << category
+                << "\", \"ph\": \"X\", \"pid\": " << job << ", \"tid\": " << node << ", \"ts\": "
+                << from / 1000.0 << ", \"dur\": " << (to - from) / 1000.0 << "}";
+            first = false;
+        };
+        for (auto &job: jobs) {
+            const Message *reply = tracedReply(job.second);
+            if (!reply) { continue; }
+            const TraceHop *hops = reply->trace;
+            for (int i = 0; i < reply->traceSize; ++i) {
+                if (i > 0) {
+                    event(hopName(hops[i - 1].node) + " -> " + hopName(hops[i].node), "link", job.first,
+                          hops[i].node, hops[i - 1].sentNs, hops[i].receivedNs);
+                }
+                event(hopName(hops[i].node), "node", job.first, hops[i].node, hops[i].receivedNs,
+                      max(hops[i].sentNs, hops[i].receivedNs));
+            }
+            ++dumped;
+        }
+        out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+        cout << "OK: " << dumped << " traces written to " << path << endl;
+    }
+
+    // Splits the input evenly over the subtree rooted at `id`. Every node
+    // reduces its slice and merges its children's partial results, so the
+    // answer is combined on the way up and reaches the server once.
+    void execAll(int id, int n, ReduceOp op) {
+        vector<pair<int, int>> nodes = t.getSubtree(id);
+        if (nodes.empty()) {
+            skipValues(n);
             throw runtime_error("Error: node " + to_string(id) + " doesn't exist");
         }
-        if (!check(id)) {
-            throw runtime_error("Error: node " + to_string(id) + " is unavailable");
+        int k = (int) nodes.size();
+        int share = (n + k - 1) / k;
+        if (op == ReduceOp::DOT) {
+            share += share % 2;
+            if (n % 2) {
+                skipValues(n);
+                throw runtime_error("Error: dot expects interleaved pairs");
+            }
         }
-        send(Message(CommandType::EXEC_CHILD, id, n, nums, 0));
+        if (share > MAX_CAP - 1) {
+            skipValues(n);
+            throw runtime_error("Error: subtree of node " + to_string(id) + " can take at most " +
+                                to_string(k * (MAX_CAP - 1)) + " values");
+        }
+        Message msg(CommandType::EXEC_PART, id, id);
+        msg.opcode = (uint8_t) op;
+        typePayload(msg);
+        Job &job = jobs[nextJob];
+        job.node = id;
+        job.op = op;
+        job.nodes = k;
+        expectJob(job, msg.uniqueIndex);
+        int left = n;
+        for (auto &node: nodes) {
+            msg.toIndex = node.first;
+            msg.setValue(0, PART_HOP * node.second);
+            msg.size = 1;
+            for (int i = 0; i < share && left > 0; ++i, --left) {
+                readValue(msg);
+            }
+            send(msg);
+        }
+        armJob(job, chrono::milliseconds(PART_HOP * (nodes[0].second + 1)));
+        cout << "OK: job " << nextJob++ << endl;
+    }
+
+    // With `block` the call waits until the job completes or times out.
+    // A final answer retires the job.
+    string jobResult(int id, bool block) {
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            return "Error: job " + to_string(id) + " doesn't exist";
+        }
+        string line = describeJob(id, it->second, block);
+        Job &job = it->second;
+        if (!job.reported && (job.reply.wait_for(chrono::seconds(0)) == future_status::ready ||
+                              chrono::steady_clock::now() >= job.deadline)) {
+            retireJob(it);
+        }
+        return line;
     }
 
-    bool check(int id) {
+    // Returns as soon as the node answers, or false after `timeout` ms.
+    bool check(int id, int timeout = CHECK_TIMEOUT) {
         Message msg(CommandType::RETURN, id, 0);
+        shared_future<Message> reply = correlator.expect(msg.uniqueIndex, chrono::milliseconds(timeout));
         send(msg);
-        usleep(SECOND);
-        msg.getToIndex() = SERVER_ID;
-        return lastMessage == msg;
+        if (reply.wait_for(chrono::milliseconds(timeout)) != future_status::ready) {
+            correlator.cancel(msg.uniqueIndex);
+            return false;
+        }
+        try {
+            return reply.get().command == CommandType::RETURN;
+        } catch (future_error &) {
+            return false;
+        }
     }
 
-    bool check(int id, int time) {
-        int timeout = 4 * time;
-        zmq_setsockopt(getSubscriber()->getSocket(), ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
-        Message msg(CommandType::RETURN, id, 0);
+    // A negative capacity empties the node's cache.
+    string cache(int id, double capacity) {
+        Message msg(CommandType::CACHE, id, 0);
+        msg.value[0] = capacity;
+        msg.size = 1;
+        shared_future<Message> reply = correlator.expect(msg.uniqueIndex, chrono::milliseconds(CHECK_TIMEOUT));
         send(msg);
-        usleep(timeout * 1000);
-        //msg.getToIndex() = SERVER_ID;
+        string unavailable = "Node " + to_string(id) + " is unavailable";
+        if (reply.wait_for(chrono::milliseconds(CHECK_TIMEOUT)) != future_status::ready) {
+            correlator.cancel(msg.uniqueIndex);
+            return unavailable;
+        }
+        try {
+            const Message &answer = reply.get();
+            if (answer.command != CommandType::CACHE || answer.size < 2) {
+                return unavailable;
+            }
+            return "OK: node " + to_string(id) + " caches " + to_string((long) answer.value[0]) + " of " +
+                   to_string((long) answer.value[1]) + " results";
+        } catch (future_error &) {
+            return unavailable;
+        }
+    }
 
-        std::cout << "msg Node " << id << " " << msg.toIndex << " " << msg.createIndex << " " << msg.uniqueIndex << endl;
-        std::cout << "lst Node " << id << " " << lastMessage.toIndex << " " << lastMessage.createIndex << " " << lastMessage.uniqueIndex << endl;
-        return true;
+    // Asks every node at once, then collects the answers in order.
+    vector<string> stats(const vector<int> &ids) {
+        vector<shared_future<Message>> replies;
+        for (int id: ids) {
+            Message msg(CommandType::STATS, id, 0);
+            replies.push_back(correlator.expect(msg.uniqueIndex, chrono::milliseconds(CHECK_TIMEOUT)));
+            send(msg);
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(CHECK_TIMEOUT);
+        vector<string> lines;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            string unavailable = "Node " + to_string(ids[i]) + " is unavailable";
+            if (replies[i].wait_until(deadline) != future_status::ready) {
+                lines.push_back(unavailable);
+                continue;
+            }
+            try {
+                const Message &reply = replies[i].get();
+                if (reply.command != CommandType::STATS || reply.size < (int) Stat::COUNT) {
+                    lines.push_back(unavailable);
+                    continue;
+                }
+                ostringstream out;
+                out << "OK: node " << ids[i] << ":";
+                for (int stat = 0; stat < (int) Stat::COUNT; ++stat) {
+                    out << " " << statName((Stat) stat) << "=" << (uint64_t) reply.value[stat];
+                }
+                lines.push_back(out.str());
+            } catch (future_error &) {
+                lines.push_back(unavailable);
+            }
+        }
+        return lines;
+    }
+
+    // Tears the tree down leaves first; true once node 0 acknowledged,
+    // which it only does after its whole subtree has.
+    bool shutdown() {
+        int budget = SHUTDOWN_HOP * getTree().getDepth();
+        double limits[] = {(double) budget, (double) SHUTDOWN_HOP};
+        Message msg(CommandType::REMOVE_CHILD, 0, 2, limits, 0);
+        chrono::milliseconds timeout(budget + SHUTDOWN_HOP);
+        shared_future<Message> reply = correlator.expect(msg.uniqueIndex, timeout);
+        send(msg);
+        if (reply.wait_for(timeout) != future_status::ready) {
+            correlator.cancel(msg.uniqueIndex);
+            return false;
+        }
+        try {
+            return reply.get().command == CommandType::REMOVE_CHILD;
+        } catch (future_error &) {
+            return false;
+        }
+    }
+
+    // One PING broadcast; returns the ids that answered within the budget
+    // of `hop` ms per tree level.
+    set<int> ping(int hop) {
+        int budget = hop * treeView()->depth;
+        double limits[] = {(double) budget, (double) hop};
+        Message msg(CommandType::PING, UNIVERSAL_MESSAGE, 2, limits, 0);
+        chrono::milliseconds timeout(budget + hop);
+        {
+            lock_guard<mutex> guard(sweepLock);
+            sweeps[msg.uniqueIndex] = {};
+        }
+        shared_future<Message> reply = correlator.expect(msg.uniqueIndex, timeout);
+        send(msg);
+        bool answered = reply.wait_for(timeout) == future_status::ready;
+        if (!answered) {
+            correlator.cancel(msg.uniqueIndex);
+        }
+        lock_guard<mutex> guard(sweepLock);
+        set<int> live;
+        if (answered) {
+            live = move(sweeps[msg.uniqueIndex].live);
+        }
+        sweeps.erase(msg.uniqueIndex);
+        return live;
+    }
+
+    // Collects one frame of node 0's answer to a PING; true once all of
+    // them are in. The frames may be handled out of order when the reply
+    // queue overflows, so they are counted rather than trusted to end last.
+    bool sweepFrame(const Message &msg) {
+        lock_guard<mutex> guard(sweepLock);
+        auto it = sweeps.find(msg.uniqueIndex);
+        if (it == sweeps.end()) {
+            return false;
+        }
+        Sweep &sweep = it->second;
+        for (int i = 0; i < msg.size; ++i) {
+            sweep.live.insert((int) msg.value[i]);
+        }
+        ++sweep.received;
+        if (msg.flags & WIRE_LAST_CHUNK) {
+            sweep.total = msg.createIndex + 1;
+        }
+        return sweep.received == sweep.total;
     }
 
     Socket *&getPublisher() {
@@ -135,19 +906,51 @@ public:
         return subscriber;
     }
 
+    Socket *getControlPublisher() {
+        return controlPublisher;
+    }
+
+    Socket *&getControlSubscriber() {
+        return controlSubscriber;
+    }
+
+    Socket *getRouter() {
+        return router;
+    }
+
+    Socket *getOutbox() {
+        return outboxPull;
+    }
+
+    const NodeOptions &getOptions() const {
+        return options;
+    }
+
+    bool isWorking() const {
+        return working;
+    }
+
     void *getContext() {
         return context;
     }
 
+    // Only the command thread may use the tree; other threads read the
+    // snapshot published after each change.
     Tree &getTree() {
         return t;
     }
 
-    Message lastMessage;
+    shared_ptr<const TreeSnapshot> treeView() const {
+        return atomic_load(&view);
+    }
+
+    Correlator &getCorrelator() {
+        return correlator;
+    }
 
     pthread_t heartbeatThread;
-    int heartbeatTime;
-    bool isHeartbeat;
+    atomic<int> heartbeatTime{0};
+    atomic<bool> isHeartbeat{false};
 
     void heartbeat() {
         if (!isHeartbeat) {
@@ -155,9 +958,7 @@ public:
             cin >> time;
             heartbeatTime = time;
             isHeartbeat = true;
-            if (pthread_create(&heartbeatThread, nullptr, heartbeatFunction, this) != 0) {
-                throw runtime_error("thread create error");
-            }
+            startThread(heartbeatThread, heartbeatFunction, this);
         } else {
             isHeartbeat = false;
             if (pthread_join(heartbeatThread, nullptr) != 0) {
@@ -167,12 +968,158 @@ public:
     }
 
 private:
+    struct Job {
+        int node;
+        int64_t uniqueIndex = 0;
+        shared_future<Message> reply;
+        chrono::steady_clock::time_point deadline;
+        ReduceOp op = ReduceOp::SUM;
+        // Subtree size for exec-all jobs.
+        int nodes = 1;
+        bool traced = false;
+        // Only traced jobs are kept once reported.
+        bool reported = false;
+    };
+
+    // Registered before the first frame is sent; the clock only starts
+    // with armJob once the last one is, however long reading the input took.
+    void expectJob(Job &job, int64_t uniqueIndex) {
+        job.uniqueIndex = uniqueIndex;
+        job.reply = correlator.expect(uniqueIndex);
+    }
+
+    void armJob(Job &job, chrono::milliseconds timeout) {
+        job.deadline = chrono::steady_clock::now() + timeout;
+        correlator.arm(job.uniqueIndex, timeout);
+    }
+
+    // Drops a job whose result has been reported. A traced one stays for
+    // `trace` until TRACE_HISTORY newer traced jobs are reported.
+    void retireJob(map<int, Job>::iterator it) {
+        correlator.cancel(it->second.uniqueIndex);
+        if (!it->second.traced) {
+            jobs.erase(it);
+            return;
+        }
+        it->second.reported = true;
+        tracedJobs.push_back(it->first);
+        if (tracedJobs.size() > TRACE_HISTORY) {
+            jobs.erase(tracedJobs.front());
+            tracedJobs.pop_front();
+        }
+    }
+
+    string describeJob(int id, Job &job, bool block) {
+        string prefix = "job " + to_string(id) + ": ";
+        // Past its deadline a job can only fail; dropping it from the
+        // correlator breaks its promise, so neither wait below blocks.
+        if (chrono::steady_clock::now() >= job.deadline) {
+            correlator.cancel(job.uniqueIndex);
+        }
+        future_status status = block ? job.reply.wait_until(job.deadline) : job.reply.wait_for(chrono::seconds(0));
+        if (status != future_status::ready) {
+            return block ? "Error: " + prefix + "node " + to_string(job.node) + " is unavailable" : prefix + "pending";
+        }
+        try {
+            const Message &reply = job.reply.get();
+            if (reply.command == CommandType::EXEC_PART && reply.size >= 4) {
+                Accumulator acc(job.op);
+                acc.value = reply.value[0];
+                acc.compensation = reply.value[1];
+                acc.count = (int64_t) reply.value[2];
+                ostringstream out;
+                out << "OK: " << prefix << "response from subtree " << job.node << " is " << acc.result()
+                    << " (" << reply.value[3] << " of " << job.nodes << " nodes)";
+                return out.str();
+            }
+            if (reply.command != CommandType::EXEC_CHILD) {
+                return "Error: " + prefix + "node " + to_string(job.node) + " is unavailable";
+            }
+            ostringstream out;
+            out << "OK: " << prefix << "response from node " << reply.createIndex << " is " << reply.value[0];
+            return out.str();
+        } catch (future_error &) {
+            return "Error: " + prefix + "node " + to_string(job.node) + " is unavailable";
+        }
+    }
+
+    // nullptr unless the job was traced and has already completed.
+    static const Message *tracedReply(Job &job) {
+        if (!job.traced || job.reply.wait_for(chrono::seconds(0)) != future_status::ready) {
+            return nullptr;
+        }
+        try {
+            const Message &reply = job.reply.get();
+            return (reply.flags & WIRE_TRACED) && reply.traceSize > 1 ? &reply : nullptr;
+        } catch (future_error &) {
+            return nullptr;
+        }
+    }
+
+    // Every node adds about a dozen sockets to the shared context, and each
+    // socket holds a file descriptor.
+    void hostLimits() {
+        zmq_ctx_set(context, ZMQ_MAX_SOCKETS, THREADED_MAX_SOCKETS);
+        rlimit files{};
+        if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+            files.rlim_cur = files.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &files);
+        }
+    }
+
+    void publishTree() {
+        atomic_store(&view, t.snapshot());
+    }
+
+    map<int, Job> jobs;
+    // Reported traced jobs, oldest first.
+    deque<int> tracedJobs;
+    int nextJob = 0;
     pid_t pid;
     Tree t;
+    shared_ptr<const TreeSnapshot> view;
+    vector<Message> replySlots;
+    MPMCQueue<Message *> freeReplies;
+    MPMCQueue<Message *> replies;
+    sem_t replyReady;
+    atomic<bool> dispatching{false};
+    pthread_t dispatcher;
+    Correlator correlator;
     void *context;
+    // Bulk lane to and from node 0, and the control lane; see Lane.
     Socket *publisher;
     Socket *subscriber;
-    bool working;
+    Socket *controlPublisher;
+    Socket *controlSubscriber;
+    // ROUTER and the outbox pair are only touched by the receive thread;
+    // other threads queue direct requests through outboxPush under sendLock.
+    Socket *router;
+    Socket *outboxPull;
+    Socket *outboxPush;
+    mutex sendLock;
+    mutex routeLock;
+    // Live ids gathered so far for each PING in flight.
+    struct Sweep {
+        set<int> live;
+        int received = 0;
+        int total = -1;
+    };
+    mutex sweepLock;
+    unordered_map<int64_t, Sweep> sweeps;
+    promise<void> rootReady;
+    shared_future<void> rootReadyFuture = rootReady.get_future().share();
+    atomic<bool> rootAnnounced{false};
+    // Set once the first send has waited for node 0, however that ended.
+    atomic<bool> rootWaited{false};
+    set<int> routable;
+    atomic<bool> directRouting{false};
+    // exec requests carry a hop trace while set.
+    bool tracing = false;
+    // How exec inputs are read and shipped; see the payload command.
+    PayloadType payloadType = PayloadType::INT32;
+    PayloadEncoding payloadEncoding = PayloadEncoding::VARINT;
+    NodeOptions options;
+    atomic<bool> working{false};
     pthread_t receiveMessage;
 };
 
@@ -180,33 +1127,84 @@ private:
 void *receiveFunction(void *server) {
     auto *serverPointer = (Server *) server;
     try {
-        pid_t child_pid = fork();
-        if (child_pid == -1) throw runtime_error("Can not fork.");
-        if (child_pid == 0) {
-            execl("client", "client", "0", serverPointer->getPublisher()->getAddress().data(), nullptr);
-            throw runtime_error("Can not execl");
-        }
-        string address = createAddress(AddressType::PARENT_PUB, child_pid);
-        serverPointer->getSubscriber() = new Socket(serverPointer->getContext(), SocketType::SUBSCRIBER, address);
-        serverPointer->getTree().insert(0);
-        while(true) {
-
-            Message msg = serverPointer->getSubscriber()->receive();
-            if (msg.command == CommandType::ERROR) {
-                continue;
+        // Node 0 publishes into these inboxes, so they are bound before node 0 starts.
+        for (Socket **inbox: {&serverPointer->getSubscriber(), &serverPointer->getControlSubscriber()}) {
+            string address = createAddress(AddressType::CHILD_INBOX, Client::nextKey(),
+                                           serverPointer->getOptions().transport);
+            *inbox = new Socket(serverPointer->getContext(), SocketType::SUBSCRIBER, address, "", SocketRole::BIND);
+        }
+        Socket *subscriber = serverPointer->getSubscriber();
+        Socket *controlSubscriber = serverPointer->getControlSubscriber();
+        LinkAddresses link = {serverPointer->getPublisher()->getAddress(),
+                              serverPointer->getControlPublisher()->getAddress(), subscriber->getAddress(),
+                              controlSubscriber->getAddress()};
+        if (serverPointer->getOptions().threaded) {
+            Client::host(0, link, serverPointer->getOptions(), serverPointer->getContext(), Client::nextKey());
+        } else {
+            pid_t child_pid = fork();
+            if (child_pid == -1) throw runtime_error("Can not fork.");
+            if (child_pid == 0) {
+                execClient(0, link, serverPointer->getOptions());
             }
-            serverPointer->lastMessage = msg;
-            switch (msg.command) {
-                case CommandType::CREATE_CHILD:
-                    cout << "OK: " << msg.getCreateIndex() << endl;
-                    break;
-                case CommandType::RETURN:
-                    break;
-                case CommandType::EXEC_CHILD:
-                    cout << "OK: response from node " << msg.getCreateIndex() << " is " << msg.value[0] << endl;
-                    break;
-                default:
+        }
+        Socket *router = serverPointer->getRouter();
+        Socket *outbox = serverPointer->getOutbox();
+        while (serverPointer->isWorking()) {
+            // Control replies come first, so a backlog of exec results
+            // never holds them up by more than one frame.
+            zmq_pollitem_t items[] = {
+                    {controlSubscriber->getSocket(), 0, ZMQ_POLLIN, 0},
+                    {subscriber->getSocket(), 0, ZMQ_POLLIN, 0},
+                    {router->getSocket(), 0, ZMQ_POLLIN, 0},
+                    {outbox->getSocket(), 0, ZMQ_POLLIN, 0},
+            };
+            if (zmq_poll(items, 4, POLL_INTERVAL) == -1) {
+                if (zmq_errno() == EINTR) { continue; }
+                throw runtime_error("poll error");
+            }
+            for (int i = 0; i < RECEIVE_BATCH && (items[0].revents & ZMQ_POLLIN); ++i) {
+                zmq_msg_t frame;
+                zmq_msg_init(&frame);
+                bool received = controlSubscriber->receiveFrame(&frame, ZMQ_DONTWAIT);
+                if (received && !serverPointer->readyFrame(&frame, Lane::CONTROL)) {
+                    serverPointer->dispatch(&frame);
+                }
+                zmq_msg_close(&frame);
+                if (!received) {
                     break;
+                }
+            }
+            if (items[1].revents & ZMQ_POLLIN) {
+                zmq_msg_t frame;
+                zmq_msg_init(&frame);
+                if (subscriber->receiveFrame(&frame) && !serverPointer->readyFrame(&frame, Lane::BULK)) {
+                    serverPointer->dispatch(&frame);
+                }
+                zmq_msg_close(&frame);
+            }
+            if (items[2].revents & ZMQ_POLLIN) {
+                string identity;
+                zmq_msg_t frame;
+                zmq_msg_init(&frame);
+                if (router->receiveFrom(identity, &frame)) {
+                    serverPointer->dispatch(&frame);
+                }
+                zmq_msg_close(&frame);
+            }
+            if (items[3].revents & ZMQ_POLLIN) {
+                zmq_msg_t frame;
+                zmq_msg_init(&frame);
+                WireHeader header{};
+                // A missing exec-all member only leaves its slice out; its
+                // parent gives up on it when the part deadline passes.
+                if (outbox->receiveFrame(&frame) && peekHeader(&frame, header) &&
+                    !router->sendTo(to_string(header.toIndex), &frame) &&
+                    (CommandType) header.command != CommandType::EXEC_PART) {
+                    Message error;
+                    error.uniqueIndex = header.uniqueIndex;
+                    serverPointer->handleReply(error);
+                }
+                zmq_msg_close(&frame);
             }
         }
     } catch (runtime_error &err) {
@@ -218,18 +1216,26 @@ void *receiveFunction(void *server) {
 void *heartbeatFunction(void *server) {
     auto *serverPointer = (Server *) server;
     while (serverPointer->isHeartbeat) {
-        vector<int> tmp = serverPointer->getTree().getElements();
+        shared_ptr<const TreeSnapshot> view = serverPointer->treeView();
+        set<int> live = serverPointer->ping(serverPointer->heartbeatTime);
         bool answer = true;
-        for (int &e: tmp) {
-            if (!(serverPointer->check(e, serverPointer->heartbeatTime))) {
+        for (int e: view->ids) {
+            if (!live.count(e)) {
                 answer = false;
-                cout << "Heartbeat: node " << e << " is unavailable now\n";
+                cout << "Heartbeat: node " << e << " is unavailable now" << endl;
             }
         }
         if (answer) {
-            cout << "OK\n";
+            cout << "OK" << endl;
         }
+        usleep(serverPointer->heartbeatTime * 1000);
     }
+    return nullptr;
+}
+
+void *dispatchFunction(void *server) {
+    ((Server *) server)->dispatchReplies();
+    return nullptr;
 }
 
 Server *serverPointer = nullptr;
@@ -242,7 +1248,7 @@ void terminate(int) {
     exit(0);
 }
 
-int main() {
+int main(int argc, char const *argv[]) {
     try {
 
         // ctrl + C
@@ -260,7 +1266,9 @@ int main() {
             throw runtime_error("Can not set SIGTERM signal");
         }
 
-        Server server = Server();
+        NodeOptions options;
+        options.parse(argc, argv, 1);
+        Server server(options);
         serverPointer = &server;
         cout << getpid() << " server started correctly!\n";
         while (true) {
@@ -0,0 +1,197 @@
+// Round-trips every PayloadType in every PayloadEncoding through
+// encodeMessage/decodeMessage, edge values included, and feeds
+// decodeMessage truncated and malformed varints. Exits non-zero on the
+// first mismatch.
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <random>
+#include <string>
+#include <vector>
+#include "../headers/message.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void expect(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        ++failures;
+    }
+}
+
+static vector<char> encode(const Message &msg) {
+    vector<char> buffer(encodedSize(msg));
+    encodeMessage(msg, buffer.data());
+    return buffer;
+}
+
+// Decodes from a buffer of exactly `length` bytes, so a read past its end
+// is one past the allocation.
+static bool decode(const vector<char> &buffer, size_t length, Message &msg) {
+    vector<char> exact(buffer.begin(), buffer.begin() + length);
+    return decodeMessage(exact.data(), exact.size(), msg);
+}
+
+static Message filled(PayloadType type, PayloadEncoding encoding, const vector<int64_t> &values) {
+    Message msg(CommandType::EXEC_CHILD, 7, 3);
+    msg.type = type;
+    msg.encoding = encoding;
+    msg.opcode = 2;
+    msg.size = (int) values.size();
+    for (int i = 0; i < msg.size; ++i) {
+        switch (type) {
+            case PayloadType::FLOAT64: msg.value[i] = (double) values[i] / 3; break;
+            case PayloadType::FLOAT32: msg.floats[i] = (float) values[i] / 3; break;
+            case PayloadType::INT32: msg.ints[i] = (int32_t) values[i]; break;
+            case PayloadType::INT64: msg.longs[i] = values[i]; break;
+        }
+    }
+    return msg;
+}
+
+static string name(PayloadType type, PayloadEncoding encoding, const string &values) {
+    static const char *types[] = {"float64", "float32", "int32", "int64"};
+    static const char *encodings[] = {"raw", "varint", "delta"};
+    return string(types[(int) type]) + "/" + encodings[(int) encoding] + " " + values;
+}
+
+static void roundTrip(PayloadType type, PayloadEncoding encoding, const vector<int64_t> &values,
+                      const string &label) {
+    string what = name(type, encoding, label);
+    Message sent = filled(type, encoding, values);
+    vector<char> buffer = encode(sent);
+    Message got;
+    if (!decode(buffer, buffer.size(), got)) {
+        expect(false, what + ": decode");
+        return;
+    }
+    expect(got.command == sent.command && got.toIndex == sent.toIndex && got.createIndex == sent.createIndex &&
+           got.uniqueIndex == sent.uniqueIndex && got.opcode == sent.opcode, what + ": header");
+    expect(got.type == type && got.size == sent.size, what + ": type and size");
+    size_t raw = sent.size * payloadWidth(type);
+    expect(memcmp(got.value, sent.value, raw) == 0, what + ": values");
+    // Packing never costs more than RAW, which it falls back to.
+    expect(buffer.size() <= sizeof(WireHeader) + raw, what + ": size");
+    for (size_t length = 0; length < buffer.size(); ++length) {
+        if (decode(buffer, length, got)) {
+            expect(false, what + ": truncated to " + to_string(length) + " bytes");
+            break;
+        }
+    }
+    vector<char> longer = buffer;
+    longer.push_back(0);
+    expect(!decode(longer, longer.size(), got), what + ": trailing byte");
+}
+
+static void roundTrips() {
+    vector<pair<string, vector<int64_t>>> int64Cases = {
+            {"empty", {}},
+            {"zero", {0}},
+            {"small", {1, -1, 2, -2, 63, -64, 64, -65}},
+            {"extremes", {INT64_MIN, INT64_MAX, 0, INT64_MIN, -1, INT64_MAX, INT64_MAX, INT64_MIN}},
+            {"ramp", {}},
+    };
+    for (int i = 0; i < MAX_CAP; ++i) {
+        int64Cases.back().second.push_back(1000 + 3 * i);
+    }
+    vector<pair<string, vector<int64_t>>> int32Cases = {
+            {"empty", {}},
+            {"extremes", {INT32_MIN, INT32_MAX, 0, INT32_MIN, -1, INT32_MAX, INT32_MAX, INT32_MIN}},
+            {"descending", {}},
+    };
+    for (int i = 0; i < MAX_CAP; ++i) {
+        int32Cases.back().second.push_back(500 - 7 * i);
+    }
+    mt19937_64 random(23);
+    vector<int64_t> wide(MAX_CAP), narrow(MAX_CAP);
+    for (int i = 0; i < MAX_CAP; ++i) {
+        wide[i] = (int64_t) random();
+        narrow[i] = (int32_t) random();
+    }
+    int64Cases.emplace_back("random", wide);
+    int32Cases.emplace_back("random", narrow);
+    for (PayloadEncoding encoding: {PayloadEncoding::RAW, PayloadEncoding::VARINT, PayloadEncoding::DELTA}) {
+        for (auto &[label, values]: int64Cases) {
+            roundTrip(PayloadType::INT64, encoding, values, label);
+            roundTrip(PayloadType::FLOAT64, encoding, values, label);
+            roundTrip(PayloadType::FLOAT32, encoding, values, label);
+        }
+        for (auto &[label, values]: int32Cases) {
+            roundTrip(PayloadType::INT32, encoding, values, label);
+        }
+    }
+}
+
+// Small integers must actually shrink, or the packed encodings are moot.
+static void packing() {
+    vector<int64_t> ramp;
+    for (int i = 0; i < MAX_CAP; ++i) {
+        ramp.push_back(1000 + i);
+    }
+    size_t raw = encode(filled(PayloadType::INT64, PayloadEncoding::RAW, ramp)).size();
+    size_t varint = encode(filled(PayloadType::INT64, PayloadEncoding::VARINT, ramp)).size();
+    size_t delta = encode(filled(PayloadType::INT64, PayloadEncoding::DELTA, ramp)).size();
+    expect(varint < raw / 3, "varint packs a ramp");
+    expect(delta < varint, "delta packs a ramp tighter than varint");
+}
+
+// A frame of `size` INT64 (or INT32) values whose payload is `payload` as is.
+static vector<char> frame(PayloadType type, PayloadEncoding encoding, int size, const vector<uint8_t> &payload) {
+    WireHeader header{};
+    header.version = WIRE_VERSION;
+    header.command = (uint8_t) CommandType::EXEC_CHILD;
+    header.flags = (uint8_t) type << WIRE_TYPE_SHIFT | (uint8_t) encoding << WIRE_ENCODING_SHIFT;
+    header.size = size;
+    vector<char> buffer(sizeof(header) + payload.size());
+    memcpy(buffer.data(), &header, sizeof(header));
+    copy(payload.begin(), payload.end(), buffer.begin() + sizeof(header));
+    return buffer;
+}
+
+static void malformed() {
+    Message msg;
+    vector<uint8_t> nine(9, 0xFF);
+    // Ten bytes carry 64 bits: the last one may only hold the top bit.
+    vector<uint8_t> top = nine;
+    top.push_back(0x01);
+    vector<char> buffer = frame(PayloadType::INT64, PayloadEncoding::VARINT, 1, top);
+    expect(decode(buffer, buffer.size(), msg) && msg.longs[0] == INT64_MIN, "ten byte varint");
+    vector<uint8_t> overflow = nine;
+    overflow.push_back(0x02);
+    buffer = frame(PayloadType::INT64, PayloadEncoding::VARINT, 1, overflow);
+    expect(!decode(buffer, buffer.size(), msg), "varint overflowing 64 bits");
+    vector<uint8_t> eleven(10, 0x80);
+    eleven.push_back(0x00);
+    buffer = frame(PayloadType::INT64, PayloadEncoding::VARINT, 1, eleven);
+    expect(!decode(buffer, buffer.size(), msg), "eleven byte varint");
+    // The continuation bit on the last byte asks for bytes that are not there.
+    buffer = frame(PayloadType::INT64, PayloadEncoding::DELTA, 2, {0x02, 0x81});
+    expect(!decode(buffer, buffer.size(), msg), "varint cut off by the frame end");
+    buffer = frame(PayloadType::INT64, PayloadEncoding::VARINT, 3, {0x02, 0x04});
+    expect(!decode(buffer, buffer.size(), msg), "fewer varints than size");
+    // 2^31 zigzagged, one past INT32_MAX.
+    buffer = frame(PayloadType::INT32, PayloadEncoding::VARINT, 1, {0x80, 0x80, 0x80, 0x80, 0x10});
+    expect(!decode(buffer, buffer.size(), msg), "varint out of int32 range");
+    buffer = frame(PayloadType::INT32, PayloadEncoding::DELTA, 2, {0xFE, 0xFF, 0xFF, 0xFF, 0x0F, 0x02});
+    expect(!decode(buffer, buffer.size(), msg), "delta running past INT32_MAX");
+    buffer = frame(PayloadType::FLOAT64, PayloadEncoding::VARINT, 1, {0x02});
+    expect(!decode(buffer, buffer.size(), msg), "packed floats");
+    buffer = frame(PayloadType::INT64, PayloadEncoding::VARINT, MAX_CAP + 1, vector<uint8_t>(MAX_CAP + 1, 0));
+    expect(!decode(buffer, buffer.size(), msg), "more than MAX_CAP values");
+    buffer = frame(PayloadType::INT64, PayloadEncoding::VARINT, -1, {});
+    expect(!decode(buffer, buffer.size(), msg), "negative size");
+}
+
+int main() {
+    roundTrips();
+    packing();
+    malformed();
+    if (failures) {
+        return 1;
+    }
+    cout << "codec: OK" << endl;
+    return 0;
+}
@@ -0,0 +1,187 @@
+// Checks every reduction kernel against a plain scalar loop for each
+// payload type, on ns that leave every possible tail of the vector
+// loops and on unaligned starts, plus the compensated sum on inputs where
+// naive summation cancels. Exits non-zero on the first mismatch.
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "../headers/kernels.h"
+
+using namespace std;
+
+static const double INF = numeric_limits<double>::infinity();
+
+static int failures = 0;
+
+static void expect(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        ++failures;
+    }
+}
+
+// Vector loops add in a different order, so floating results may differ
+// from the reference by rounding; integer results must match exactly.
+static bool close(double got, double want, double scale) {
+    if (isinf(want)) {
+        return got == want;
+    }
+    return fabs(got - want) <= 1e-12 * max(1.0, scale);
+}
+
+template<class T>
+struct Reference {
+    double sum = 0, min = INF, max = -INF, dot = 0;
+    // Sums of absolute values, which bound the rounding error of a reordering.
+    double magnitude = 0, dotMagnitude = 0;
+
+    Reference(const T *values, size_t n) {
+        long double s = 0, d = 0;
+        for (size_t i = 0; i < n; ++i) {
+            s += values[i];
+            min = std::min(min, (double) values[i]);
+            max = std::max(max, (double) values[i]);
+            magnitude += fabs((double) values[i]);
+        }
+        for (size_t i = 0; i + 2 <= n; i += 2) {
+            d += (long double) values[i] * values[i + 1];
+            dotMagnitude += fabs((double) values[i] * values[i + 1]);
+        }
+        sum = (double) s;
+        dot = (double) d;
+    }
+};
+
+template<class T>
+static vector<T> randomValues(mt19937_64 &random, size_t n);
+
+template<>
+vector<double> randomValues(mt19937_64 &random, size_t n) {
+    uniform_real_distribution<double> values(-1000, 1000);
+    vector<double> out(n);
+    for (auto &value: out) { value = values(random); }
+    return out;
+}
+
+template<>
+vector<float> randomValues(mt19937_64 &random, size_t n) {
+    uniform_real_distribution<float> values(-1000, 1000);
+    vector<float> out(n);
+    for (auto &value: out) { value = values(random); }
+    return out;
+}
+
+// Integer kernels accumulate in 64 bits, so the ranges keep sums and
+// products of 17 values clear of overflow.
+template<>
+vector<int32_t> randomValues(mt19937_64 &random, size_t n) {
+    uniform_int_distribution<int32_t> values(-(1 << 24), 1 << 24);
+    vector<int32_t> out(n);
+    for (auto &value: out) { value = values(random); }
+    return out;
+}
+
+template<>
+vector<int64_t> randomValues(mt19937_64 &random, size_t n) {
+    uniform_int_distribution<int64_t> values(-(1LL << 28), 1LL << 28);
+    vector<int64_t> out(n);
+    for (auto &value: out) { value = values(random); }
+    return out;
+}
+
+template<class T>
+static double folded(ReduceOp op, const T *values, size_t n) {
+    Accumulator acc(op);
+    acc.fold(values, n);
+    return acc.result();
+}
+
+// Folds the first half into one accumulator and the rest into another,
+// then merges them, as a node does with the partial results of its children.
+template<class T>
+static double merged(ReduceOp op, const T *values, size_t n) {
+    size_t half = n / 2 & ~(size_t) 1;
+    Accumulator left(op), right(op);
+    left.fold(values, half);
+    right.fold(values + half, n - half);
+    left.merge(right);
+    return left.result();
+}
+
+template<class T>
+static void compare(const string &type) {
+    mt19937_64 random(9);
+    for (size_t n: {0, 1, 3, 7, 9, 17}) {
+        // One spare value, so the same n values are also read from an unaligned start.
+        vector<T> buffer = randomValues<T>(random, n + 1);
+        for (size_t offset: {0, 1}) {
+            const T *values = buffer.data() + offset;
+            Reference<T> want(values, n);
+            double scale = want.magnitude;
+            string what = type + " n=" + to_string(n) + (offset ? " unaligned" : "") + ": ";
+            expect(close(reduceSum(values, n), want.sum, scale), what + "sum");
+            double sum = 0, compensation = 0;
+            reduceKahanSum(values, n, sum, compensation);
+            expect(close(sum + compensation, want.sum, scale), what + "compensated sum");
+            expect(reduceMin(values, n) == want.min, what + "min");
+            expect(reduceMax(values, n) == want.max, what + "max");
+            expect(close(reduceDot(values, n), want.dot, want.dotMagnitude), what + "dot");
+            double mean = n ? want.sum / (double) n : 0.0;
+            expect(close(folded(ReduceOp::MEAN, values, n), mean, scale), what + "mean");
+            for (ReduceOp op: {ReduceOp::SUM, ReduceOp::KAHAN_SUM, ReduceOp::MIN, ReduceOp::MAX, ReduceOp::MEAN,
+                               ReduceOp::DOT}) {
+                double whole = folded(op, values, n);
+                expect(close(merged(op, values, n), whole, max(scale, want.dotMagnitude)),
+                       what + "merged op " + to_string((int) op));
+            }
+        }
+    }
+}
+
+// Terms that swamp each other: a naive sum loses every small one, the
+// compensated sum must come out exact, whichever kernel runs.
+static void cancellation() {
+    for (int copies: {1, 2, 3, 5, 6}) {
+        vector<double> values;
+        for (int i = 0; i < copies; ++i) {
+            values.insert(values.end(), {1e16, 1.0, -1e16});
+        }
+        double sum = 0, compensation = 0;
+        reduceKahanSum(values.data(), values.size(), sum, compensation);
+        expect(sum + compensation == copies, "compensated sum of " + to_string(copies) + " x {1e16, 1, -1e16}");
+        expect(folded(ReduceOp::KAHAN_SUM, values.data(), values.size()) == copies,
+               "ksum accumulator over " + to_string(copies) + " x {1e16, 1, -1e16}");
+    }
+    // Neumaier's example, where plain Kahan summation gives 0.
+    vector<double> values = {1.0, 1e100, 1.0, -1e100};
+    double sum = 0, compensation = 0;
+    reduceKahanSum(values.data(), values.size(), sum, compensation);
+    expect(sum + compensation == 2.0, "compensated sum of {1, 1e100, 1, -1e100}");
+    vector<float> floats = {1e8f, 1.0f, -1e8f, 1.0f, 1e8f, 1.0f, -1e8f};
+    sum = compensation = 0;
+    reduceKahanSum(floats.data(), floats.size(), sum, compensation);
+    expect(sum + compensation == 3.0, "compensated sum of floats");
+    // Merging partial results keeps the compensation of both sides.
+    Accumulator left(ReduceOp::KAHAN_SUM), right(ReduceOp::KAHAN_SUM);
+    double big[] = {1e16, 1.0}, back[] = {1.0, -1e16};
+    left.fold(big, 2);
+    right.fold(back, 2);
+    left.merge(right);
+    expect(left.result() == 2.0, "merged compensated sum");
+}
+
+int main() {
+    compare<double>("double");
+    compare<float>("float");
+    compare<int32_t>("int32");
+    compare<int64_t>("int64");
+    cancellation();
+    if (failures) {
+        return 1;
+    }
+    cout << "kernels (" << kernelIsa() << "): OK" << endl;
+    return 0;
+}
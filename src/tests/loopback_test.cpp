@@ -0,0 +1,117 @@
+// Runs the tcp transport over loopback: binds publishers on
+// createAddress's "host:*" endpoints, checks the ports boundAddress
+// discovers and the tuning applied to the sockets, round-trips a message,
+// then drives ./server --transport=tcp through create, exec, exec-all and
+// exit. Run from the build directory, next to server and client. Exits
+// non-zero on the first mismatch.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include "../headers/socket.h"
+
+using namespace std;
+
+#define HWM 100
+#define SNDBUF 65536
+
+static int failures = 0;
+
+static void expect(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        ++failures;
+    }
+}
+
+static int option(void *socket, int name) {
+    int value = 0;
+    size_t size = sizeof(value);
+    zmq_getsockopt(socket, name, &value, &size);
+    return value;
+}
+
+static void sockets() {
+    SocketTuning tuning;
+    tuning.hwm = HWM;
+    tuning.sndbuf = SNDBUF;
+    tuneSockets(tuning);
+    string address = createAddress(AddressType::CHILD_PUB_LEFT, getpid(), Transport::TCP);
+    expect(address == "tcp://127.0.0.1:*", "tcp address is " + address);
+    void *context = createContext();
+    {
+        Socket left(context, SocketType::PUBLISHER, address);
+        Socket right(context, SocketType::PUBLISHER,
+                     createAddress(AddressType::CHILD_PUB_RIGHT, getpid(), Transport::TCP));
+        string bound = left.getAddress();
+        expect(bound.rfind("tcp://127.0.0.1:", 0) == 0 && bound.find('*') == string::npos,
+               "bound address is " + bound);
+        expect(bound != right.getAddress(), "each bind gets its own port");
+        expect(option(left.getSocket(), ZMQ_SNDHWM) == HWM && option(left.getSocket(), ZMQ_RCVHWM) == HWM, "hwm");
+        expect(option(left.getSocket(), ZMQ_SNDBUF) == SNDBUF, "sndbuf");
+
+        Socket subscriber(context, SocketType::SUBSCRIBER, bound);
+        double values[] = {1.5, -2, 3};
+        Message sent(CommandType::EXEC_CHILD, 7, 3, values, 4);
+        // A subscriber misses what was published before it joined, so
+        // publish until one copy arrives.
+        bool received = false;
+        for (int attempt = 0; attempt < 200 && !received; ++attempt) {
+            left.send(sent);
+            zmq_pollitem_t item = {subscriber.getSocket(), 0, ZMQ_POLLIN, 0};
+            received = zmq_poll(&item, 1, 10) > 0;
+        }
+        expect(received, "message over tcp");
+        if (received) {
+            expect(subscriber.receive() == sent, "message survives the round trip");
+        }
+    }
+    destroyContext(context);
+}
+
+static const char *SCRIPT =
+        "create 5\n"
+        "create 3\n"
+        "create 8\n"
+        "exec 8 3 1 2 3\n"
+        "exec-all 5 4 1 2 3 4\n"
+        "wait\n"
+        "exit\n";
+
+// The children bind their publishers on ephemeral ports and report them
+// up the tree, so every reply proves an endpoint was discovered.
+static void server() {
+    string output = "loopback_server_" + to_string(getpid()) + ".out";
+    string command = "./server --transport=tcp --hwm=" + to_string(HWM) + " --sndbuf=" + to_string(SNDBUF) +
+                     " > " + output + " 2>&1";
+    FILE *input = popen(command.data(), "w");
+    if (!input) {
+        expect(false, "start ./server");
+        return;
+    }
+    fputs(SCRIPT, input);
+    expect(pclose(input) == 0, "server exits cleanly");
+    ifstream file(output);
+    stringstream text;
+    text << file.rdbuf();
+    string log = text.str();
+    unlink(output.data());
+    expect(log.find("OK: job 0: response from node 8 is 6") != string::npos, "exec over tcp");
+    expect(log.find("OK: job 1: response from subtree 5 is 10 (3 of 3 nodes)") != string::npos,
+           "exec-all over tcp");
+    if (failures) {
+        cerr << log;
+    }
+}
+
+int main() {
+    sockets();
+    server();
+    if (failures) {
+        return 1;
+    }
+    cout << "loopback: OK" << endl;
+    return 0;
+}
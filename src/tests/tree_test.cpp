@@ -0,0 +1,208 @@
+// Checks the arena Tree against a plain pointer BST on random insert and
+// remove sequences: placement, depth, parents, subtrees, ids and print
+// must all agree. Exits non-zero on the first mismatch.
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <set>
+#include <string>
+#include "../headers/tree.h"
+
+using namespace std;
+
+// The recursive tree Tree replaced, cut down to what the checks need.
+class ReferenceTree {
+private:
+    struct Node {
+        int value;
+        unique_ptr<Node> left, right;
+    };
+
+    unique_ptr<Node> root;
+
+    static int depth(const Node *current) {
+        if (!current) { return 0; }
+        return 1 + max(depth(current->left.get()), depth(current->right.get()));
+    }
+
+    static void subtree(const Node *current, vector<pair<int, int>> &out) {
+        if (!current) { return; }
+        out.emplace_back(current->value, depth(current));
+        subtree(current->left.get(), out);
+        subtree(current->right.get(), out);
+    }
+
+    static void print(const Node *current, int h, ostream &out) {
+        if (!current) { return; }
+        print(current->right.get(), h + 2, out);
+        out << string(h, '-') << current->value << '\n';
+        print(current->left.get(), h + 2, out);
+    }
+
+    // The link `value` hangs from, or would hang from, with its parent.
+    unique_ptr<Node> *slot(int value, const Node *&parent) {
+        unique_ptr<Node> *current = &root;
+        parent = nullptr;
+        while (*current && (*current)->value != value) {
+            parent = current->get();
+            current = value < (*current)->value ? &(*current)->left : &(*current)->right;
+        }
+        return current;
+    }
+
+public:
+    void insert(int value) {
+        const Node *parent;
+        unique_ptr<Node> *link = slot(value, parent);
+        if (!*link) {
+            *link = make_unique<Node>(Node{value, nullptr, nullptr});
+        }
+    }
+
+    void remove(int value) {
+        const Node *parent;
+        slot(value, parent)->reset();
+    }
+
+    bool find(int value) {
+        const Node *parent;
+        return *slot(value, parent) != nullptr;
+    }
+
+    int getPlace(int value) {
+        const Node *parent;
+        if (*slot(value, parent)) { return -1; }
+        return parent ? parent->value : -1;
+    }
+
+    int getParent(int value) {
+        const Node *parent;
+        if (!*slot(value, parent) || !parent) { return -1; }
+        return parent->value;
+    }
+
+    int getDepth() const {
+        return depth(root.get());
+    }
+
+    vector<pair<int, int>> getSubtree(int value) {
+        const Node *parent;
+        vector<pair<int, int>> out;
+        subtree(slot(value, parent)->get(), out);
+        return out;
+    }
+
+    string print() const {
+        ostringstream out;
+        print(root.get(), 0, out);
+        return out.str();
+    }
+};
+
+static int failures = 0;
+
+static void expect(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        ++failures;
+    }
+}
+
+static string printed(const Tree &t) {
+    ostringstream out;
+    streambuf *previous = cout.rdbuf(out.rdbuf());
+    t.print();
+    cout.rdbuf(previous);
+    return out.str();
+}
+
+static void compare(Tree &t, ReferenceTree &reference, const set<int> &present, int probe, const string &step) {
+    expect(t.getDepth() == reference.getDepth(), step + ": depth");
+    expect(t.getIds() == vector<int>(present.begin(), present.end()), step + ": ids");
+    expect(t.find(probe) == reference.find(probe), step + ": find " + to_string(probe));
+    expect(t.getPlace(probe) == reference.getPlace(probe), step + ": place of " + to_string(probe));
+    for (int id: present) {
+        if (t.getParent(id) != reference.getParent(id)) {
+            expect(false, step + ": parent of " + to_string(id));
+            break;
+        }
+    }
+    int top = present.empty() ? probe : *present.begin();
+    expect(t.getSubtree(top) == reference.getSubtree(top), step + ": subtree of " + to_string(top));
+    expect(printed(t) == reference.print(), step + ": print");
+}
+
+static void randomSequences() {
+    mt19937 random(20);
+    for (int round = 0; round < 200; ++round) {
+        Tree t;
+        ReferenceTree reference;
+        set<int> present;
+        uniform_int_distribution<int> ids(0, 40 + round);
+        for (int step = 0; step < 120; ++step) {
+            int id = ids(random);
+            string name = "round " + to_string(round) + " step " + to_string(step);
+            // Mostly inserts, so trees grow deep enough to matter.
+            if (random() % 5) {
+                t.insert(id);
+                reference.insert(id);
+                present.insert(id);
+            } else if (reference.find(id)) {
+                for (auto [gone, height]: reference.getSubtree(id)) {
+                    present.erase(gone);
+                }
+                t.remove(id);
+                reference.remove(id);
+            }
+            compare(t, reference, present, ids(random), name);
+            if (failures) { return; }
+        }
+    }
+}
+
+// A chain 1, 2, ..., n must not recurse once per level.
+static void longChain() {
+    Tree t;
+    int n = 200000;
+    for (int id = 1; id <= n; ++id) {
+        t.insert(id);
+    }
+    expect(t.getDepth() == n, "chain depth");
+    expect(t.getPlace(n + 1) == n, "chain place");
+    expect((int) t.getSubtree(1).size() == n, "chain subtree");
+    t.remove(n / 2);
+    expect(t.getDepth() == n / 2 - 1 && (int) t.getIds().size() == n / 2 - 1, "chain remove");
+}
+
+static void balanced() {
+    for (int n: {1, 2, 3, 7, 8, 100, 1023, 4096}) {
+        vector<int> values(n);
+        for (int i = 0; i < n; ++i) {
+            values[i] = 3 * i + 1;
+        }
+        vector<int> order = Tree::balancedOrder(values);
+        vector<int> sorted = order;
+        sort(sorted.begin(), sorted.end());
+        expect(sorted == values, "balanced order of " + to_string(n) + " is a permutation");
+        Tree t;
+        for (int id: order) {
+            t.insert(id);
+        }
+        int levels = 0;
+        while ((1 << levels) - 1 < n) {
+            ++levels;
+        }
+        expect(t.getDepth() == levels, "balanced depth of " + to_string(n));
+    }
+}
+
+int main() {
+    randomSequences();
+    longChain();
+    balanced();
+    if (failures) {
+        return 1;
+    }
+    cout << "tree: OK" << endl;
+    return 0;
+}